@@ -119,7 +119,7 @@ static bool cache_page_patch(cache_page *page, uint32_t mask) {
 
   // Patch flash page
   uint32_t addr = page->index * CH32_FLASH_PAGE_SIZE + CH32_FLASH_ADDR;
-  if (!flash_erase_page(addr))
+  if (!flash_erase_page(page->index))
     return false;
 
   uint16_t patched[CH32_FLASH_PAGE_WORDS * 2];
@@ -319,7 +319,7 @@ void break_dump(void) {
 bool break_resume(bool step) {
   // Find page slot
   uint32_t dpc;
-  if (!csr_get_dpc(&dpc))
+  if (!ctx_get_reg(CTX_REG_PC, &dpc))
     return false;
 
   uint16_t index = dpc / CH32_FLASH_PAGE_SIZE;
@@ -8,6 +8,7 @@
 #include "flash.h"
 #include "option.h"
 #include "packet.h"
+#include "trace.h"
 #include "vendor.h"
 
 //------------------------------------------------------------------------------
@@ -36,6 +37,20 @@ static int console_take_value(int optional, size_t size) {
   return value;
 }
 
+//------------------------------------------------------------------------------
+// Any 32-bit value, -1 is a valid one
+
+static bool console_take_word(uint32_t *value) {
+  *value = packet_take_arg(&pkt, -1);
+
+  if (pkt.error) {
+    print_r(2, "bad value:");
+    print_r(1, "expected numeric value\n");
+    return false;
+  }
+  return true;
+}
+
 //------------------------------------------------------------------------------
 
 static int console_take_addr(int optional, size_t size) {
@@ -297,6 +312,34 @@ static void console_flash_get(void) {
 
 //------------------------------------------------------------------------------
 
+static void console_flash_crc(void) {
+  print_y(0, "flash:crc\n");
+  if (!ctx_halted("checksum flash"))
+    return;
+
+  int offset = console_take_addr(0, CH32_FLASH_SIZE - 4);
+  if (offset == -1)
+    return;
+  int size = console_take_addr(CH32_FLASH_SIZE - offset, CH32_FLASH_SIZE - offset);
+  if (size == -1)
+    return;
+
+  uint32_t crc;
+  uint32_t start = time_us_32();
+  bool status = ctx_crc32(CH32_FLASH_ADDR + offset, size, &crc);
+  uint32_t us = time_us_32() - start;
+
+  if (!status) {
+    print_status(false);
+    return;
+  }
+
+  print_hex(2, "crc32", crc);
+  print_num(2, "time (us)", us);
+}
+
+//------------------------------------------------------------------------------
+
 static void console_flash_lock(void) {
   print_y(0, "flash:lock\n");
   if (!ctx_halted("lock flash"))
@@ -394,6 +437,7 @@ static void console_flash_erase_parse(void) {
 static const handler flash_handlers[] = {
   { "info",   "i",  "offset",           console_flash_info },
   { "get",    "g",  "offset",           console_flash_get },
+  { "crc",    "cr", "offset size",      console_flash_crc },
   { "erase",  "er", "page|sector|chip", console_flash_erase_parse },
   { "lock",   "lo", NULL,               console_flash_lock },
   { "unlock", "un", NULL,               console_flash_unlock }
@@ -470,13 +514,135 @@ static void console_ctx_step(void) {
 
 //------------------------------------------------------------------------------
 
+static void console_ctx_gang(void) {
+  print_y(0, "debug:gang\n");
+  int pins = console_take_value(0, 0x3FFFFFFF);
+  if (pins == -1)
+    return;
+
+  bool status = swio_gang_set(pins) && ctx_reset();
+  print_status(status);
+  if (status)
+    swio_gang_dump();
+}
+
+//------------------------------------------------------------------------------
+
+static void console_ctx_nocache(void) {
+  print_y(0, "debug:nocache\n");
+  int addr = console_take_value(-1, 0x3FFFFFFF);
+  if (addr == -1)
+    return;
+  int size = console_take_value(-1, 0x3FFFFFFF);
+  if (size == -1)
+    return;
+
+  if (size && ctx_cache_uncached(addr, addr + size - 1))
+    ctx_cache_dump();
+}
+
+//------------------------------------------------------------------------------
+
+static void console_ctx_fill(void) {
+  print_y(0, "debug:fill\n");
+  if (!ctx_halted("fill memory"))
+    return;
+
+  int addr = console_take_value(-1, 0x7FFFFFFF);
+  if (addr == -1)
+    return;
+  int size = console_take_value(-1, 0x7FFFFFFF);
+  if (size == -1)
+    return;
+  int value = console_take_value(-1, 0xFF);
+  if (value == -1)
+    return;
+
+  bool status = ctx_fill(addr, size, value);
+  print_status(status);
+}
+
+//------------------------------------------------------------------------------
+// The pattern is the low len bytes (1-4) of a number, low byte first.
+
+static void console_ctx_find(void) {
+  print_y(0, "debug:find\n");
+  if (!ctx_halted("search memory"))
+    return;
+
+  int addr = console_take_value(-1, 0x7FFFFFFF);
+  if (addr == -1)
+    return;
+  int size = console_take_value(-1, 0x7FFFFFFF);
+  if (size == -1)
+    return;
+  uint32_t value;
+  if (!console_take_word(&value))
+    return;
+  int len = console_take_value(-1, 4);
+  if (len == -1)
+    return;
+  if (!len) {
+    print_r(2, "bad value:");
+    print_r(1, "empty pattern\n");
+    return;
+  }
+
+  uint8_t pattern[4];
+  for (int i = 0; i < len; i++)
+    pattern[i] = value >> (i * 8);
+
+  uint32_t found;
+  int ret = ctx_find(addr, size, pattern, len, &found);
+  if (ret < 0)
+    print_status(false);
+  else if (!ret)
+    print_y(2, "not found\n");
+  else
+    print_hex(2, "found", found);
+}
+
+//------------------------------------------------------------------------------
+
+static void console_ctx_compare(void) {
+  print_y(0, "debug:cmp\n");
+  if (!ctx_halted("compare memory"))
+    return;
+
+  int addr1 = console_take_addr(-1, 0x7FFFFFFF);
+  if (addr1 == -1)
+    return;
+  int addr2 = console_take_addr(-1, 0x7FFFFFFF);
+  if (addr2 == -1)
+    return;
+  int size = console_take_addr(-1, 0x7FFFFFFF);
+  if (size == -1)
+    return;
+
+  uint32_t offset;
+  if (!ctx_compare(addr1, addr2, size, &offset))
+    print_status(false);
+  else if (offset == size)
+    print_y(2, "equal\n");
+  else
+    print_hex(2, "differs at", addr1 + offset);
+}
+
+//------------------------------------------------------------------------------
+
 static const handler ctx_handlers[] = {
-  { "info",   "i",  NULL, ctx_dump },
-  { "test",  NULL,  NULL, ctx_test },
-  { "halt",   "h",  NULL, console_ctx_halt },
-  { "reset",  "rs", NULL, console_ctx_reset },
-  { "resume", "r",  NULL, console_ctx_resume },
-  { "step",   "s",  NULL, console_ctx_step }
+  { "info",    "i",  NULL,                    ctx_dump },
+  { "gang",    "ga", "pins",                  console_ctx_gang },
+  { "nocache", "nc", "addr size",             console_ctx_nocache },
+  { "fill",    "fi", "addr size value",       console_ctx_fill },
+  { "find",    "fd", "addr size pattern len", console_ctx_find },
+  { "cmp",     "cm", "addr1 addr2 size",      console_ctx_compare },
+  { "test",    NULL, NULL,                    ctx_test },
+  { "bench",   "b",  NULL,                    ctx_bench },
+  { "halt",    "h",  NULL,                    console_ctx_halt },
+  { "reset",   "rs", NULL,                    console_ctx_reset },
+  { "resume",  "r",  NULL,                    console_ctx_resume },
+  { "step",    "s",  NULL,                    console_ctx_step }
 };
 
 //------------------------------------------------------------------------------
@@ -495,13 +661,65 @@ static void console_ctx_parse(void) {
     handler_jump(handler);
 }
 
+//==============================================================================
+// Trace handlers
+
+static void console_trace_start(void) {
+  print_y(0, "trace:start\n");
+  trace_start();
+}
+
+//------------------------------------------------------------------------------
+
+static void console_trace_stop(void) {
+  print_y(0, "trace:stop\n");
+  trace_stop();
+}
+
+//------------------------------------------------------------------------------
+
+static void console_trace_clear(void) {
+  print_y(0, "trace:clear\n");
+  trace_clear();
+}
+
+//------------------------------------------------------------------------------
+
+static const handler trace_handlers[] = {
+  { "start",  "sa", NULL, console_trace_start },
+  { "stop",   "so", NULL, console_trace_stop },
+  { "clear",  "c",  NULL, console_trace_clear },
+  { "dump",   "d",  NULL, trace_dump },
+  { "raw",    "ra", NULL, trace_dump_raw },
+  { "replay", "re", NULL, trace_replay }
+};
+
+//------------------------------------------------------------------------------
+
+static void console_trace_help(void) {
+  console_dump_handlers(trace_handlers, count_of(trace_handlers), "trace:\n");
+}
+
+//------------------------------------------------------------------------------
+
+static void console_trace_parse(void) {
+  void *handler = handler_find(trace_handlers, count_of(trace_handlers));
+  if (!handler)
+    console_trace_help();
+  else
+    handler_jump(handler);
+}
+
 //==============================================================================
 // Info handlers
 
 static const handler info_handlers[] = {
+  { "cache",  "ca", NULL,   ctx_cache_dump },
   { "csr",    "cr", NULL,   csr_dump },
+  { "gang",   "ga", NULL,   swio_gang_dump },
   { "gpr",    "gr", NULL,   gpr_dump },
-  { "swio",   "sw", NULL,   swio_dump }
+  { "swio",   "sw", NULL,   swio_dump },
+  { "wait",   "wa", NULL,   wait_dump }
 };
 
 //------------------------------------------------------------------------------
@@ -663,6 +881,7 @@ static const handler help_handlers[] = {
   { "flash",  "fl", NULL, console_flash_help },
   { "info",   "i",  NULL, console_info_help },
   { "option", "op", NULL, console_option_help },
+  { "trace",  "tr", NULL, console_trace_help },
   { "vendor", "ve", NULL, console_vendor_help }
 };
 
@@ -693,6 +912,7 @@ static const handler console_handlers[] = {
   { "flash",  "fl", NULL, console_flash_parse },
   { "info",   "i",  NULL, console_info_parse },
   { "option", "op", NULL, console_option_parse },
+  { "trace",  "tr", NULL, console_trace_parse },
   { "vendor", "ve", NULL, console_vendor_parse }
 };
 
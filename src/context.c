@@ -17,7 +17,9 @@ uint8_t  gpr_max;
 
 //------------------------------------------------------------------------------
 // Save registers that are about to be clobbered. Skip registers already saved
-// in the cache.
+// in the cache. There is no dscratch on this core for the stubs to park them
+// in, so the values come from the register snapshot; GDB reads the register
+// file on every stop, so usually nothing crosses the link.
 
 bool gpr_cache_save(uint32_t clobber) {
 #if GPR_DUMP
@@ -29,7 +31,7 @@ bool gpr_cache_save(uint32_t clobber) {
     if (!(to_cache & (1u << i)))
       continue;
 
-    if (!gpr_get(i, &gpr_cache[i]))
+    if (!ctx_get_reg(i, &gpr_cache[i]))
       return false;
 
 #if GPR_DUMP
@@ -92,10 +94,16 @@ static void gpr_cache_dump(void) {
 static uint32_t prog_cache[DM_PROGBUFMAX];
 static uint8_t prog_size;
 
+// Per session, see "debug info"
+static uint32_t prog_loads;
+static uint32_t prog_uploads;  // Words
+
 //------------------------------------------------------------------------------
 
 static inline void prog_cache_init(uint8_t new_size) {
   prog_size = new_size;
+  prog_loads = 0;
+  prog_uploads = 0;
 
   for (size_t i = 0; i < prog_size; i++)
     prog_cache[i] = 0xDEADBEEF;
@@ -112,18 +120,24 @@ static void prog_cache_dump(void) {
     printf("  %d: %08X", i, prog_cache[i]);
   }
   putchar('\n');
+
+  print_num(1, "loads", prog_loads);
+  print_num(1, "uploaded words", prog_uploads);
 }
 
 //------------------------------------------------------------------------------
 
 void ctx_load_prog(const uint32_t *prog, uint8_t size) {
+  CHECK(size <= prog_size);
   dm_abstractcs_clear_err();
+  prog_loads++;
 
   // Upload any DM_PROGBUF(N) word that changed
   for (uint8_t i = 0; i < size; i++) {
     if (prog_cache[i] != prog[i]) {
       dm_set_progbuf(i, prog[i]);
       prog_cache[i] = prog[i];
+      prog_uploads++;
     }
   }
 }
@@ -131,57 +145,256 @@ void ctx_load_prog(const uint32_t *prog, uint8_t size) {
 //==============================================================================
 // Progbuf
 
-static uint16_t stub_mem32[] = {
+// Resident stub shared by single word and block get/set, so switching between
+// them never touches PROGBUF. DATA1 holds the address, its LSB selects a set.
+// Every run advances DATA1 by a word, which block transfers kick with
+// autoexec on DATA0. It fills all 8 words and relies on the implicit ebreak.
+
+static uint16_t stub_mem[] = {
   0x0437, 0xE000,  // lui    s0, DM_DATA_BASE[31:12]
   0x0413, 0xFFFF,  // addi   s0, s0, DM_DATA_ADDR[11:0] ; s0 = 0xE00000F4
-  0x4048,          // c.lw   a0, 4(s0)                  ; a0 = *(s0+4)  (DATA1)
-  0x8905,          // c.andi a0, a0, 1                  ; a0 &= 1
-  0xC511,          // c.beqz a0, get                    ; If a0 == 0 -> goto get
+  0x404C,          // c.lw   a1, 4(s0)                  ; a1 = *(s0+4)  (DATA1)
+  0xF513, 0x0015,  // andi   a0, a1, 1                  ; a0 = a1 & 1
+  0xE501,          // c.bnez a0, set                    ; If a0 -> goto set
+                // get:
+  0x4188,          // c.lw   a0, 0(a1)                  ; a0 = *a1      read memory
+  0xC008,          // c.sw   a0, 0(s0)                  ; *s0 = a0      (DATA0)
+  0xA021,          // c.j    next
                 // set:
   0x4008,          // c.lw   a0, 0(s0)                  ; a0 = *s0      (DATA0)
-  0x4040,          // c.lw   s0, 4(s0)                  ; s0 = *(s0+4)  (DATA1)
-  0x147D,          // c.addi s0, s0, -1                 ; s0--
-  0xC008,          // c.sw   a0, 0(s0)                  ; *s0 = a0      write to memory
-  0x9002,          // ebreak
-                // get:
-  0x4048,          // c.lw   a0, 4(s0)                  ; a0 = *(s0+4)  (DATA1)
-  0x4108,          // c.lw   a0, 0(a0)                  ; a0 = *a0      read memory
+  0xAFA3, 0xFEA5,  // sw     a0, -1(a1)                 ; *(a1-1) = a0  write to memory
+                // next:
+  0x0591,          // c.addi a1, 4                      ; a1 += 4
+  0xC04C           // c.sw   a1, 4(s0)                  ; *(s0+4) = a1  (DATA1)
+};
+
+_Static_assert(sizeof(stub_mem) == CTX_PROG_BYTES, "stub_mem");
+
+//------------------------------------------------------------------------------
+// Two words per kick: s0 = DM_DATA_ADDR and a1 = address are set up through
+// GPR writes, DATA0 and DATA1 carry the data and a DATA1 access kicks the
+// next execution.
+
+static uint16_t stub_get_block2[] = {
+  0x4188,          // c.lw   a0, 0(a1)                  ; a0 = *a1
   0xC008,          // c.sw   a0, 0(s0)                  ; *s0 = a0      (DATA0)
-  0x9002           // ebreak
+  0x41C8,          // c.lw   a0, 4(a1)                  ; a0 = *(a1+4)
+  0xC048,          // c.sw   a0, 4(s0)                  ; *(s0+4) = a0  (DATA1)
+  0x05A1,          // c.addi a1, 8                      ; a1 += 8
+  0x9002           // c.ebreak
 };
 
-_Static_assert(!(sizeof(stub_mem32) & 3), "stub_mem32");
+_Static_assert(!(sizeof(stub_get_block2) & 3) && sizeof(stub_get_block2) <= CTX_PROG_BYTES, "stub_get_block2");
 
 //------------------------------------------------------------------------------
 
-static uint16_t stub_get_block[] = {
-  0x0437, 0xE000,  // lui    s0, DM_DATA_BASE[31:12]
-  0x0413, 0xFFFF,  // addi   s0, s0, DM_DATA_ADDR[11:0] ; s0 = 0xE00000F4
+static uint16_t stub_set_block2[] = {
+  0x4008,          // c.lw   a0, 0(s0)                  ; a0 = *s0      (DATA0)
+  0xC188,          // c.sw   a0, 0(a1)                  ; *a1 = a0
   0x4048,          // c.lw   a0, 4(s0)                  ; a0 = *(s0+4)  (DATA1)
-  0x410C,          // c.lw   a1, 0(a0)                  ; a1 = *a0
-  0xC00C,          // c.sw   a1, 0(s0)                  ; *s0 = a1      (DATA0)
-  0x0511,          // c.addi a0, 4                      ; a0 += 4
-  0xC048,          // c.sw   a0, 4(s0)                  ; *(s0+4) = a0  (DATA1)
+  0xC1C8,          // c.sw   a0, 4(a1)                  ; *(a1+4) = a0
+  0x05A1,          // c.addi a1, 8                      ; a1 += 8
   0x9002           // c.ebreak
 };
 
-_Static_assert(!(sizeof(stub_get_block) & 3), "stub_get_block");
+_Static_assert(!(sizeof(stub_set_block2) & 3) && sizeof(stub_set_block2) <= CTX_PROG_BYTES, "stub_set_block2");
 
 //------------------------------------------------------------------------------
+// 8/16-bit blocks: s0 = DM_DATA_ADDR and a1 = address as above, every DATA0
+// word carries 4 bytes or 2 halfwords packed little endian. Stubs shorter than
+// the progbuf end in c.ebreak, the implicit one only follows the last word and
+// the words past ours still hold the previous stub. stub_get_block8 fills all
+// 8 words.
+
+static uint16_t stub_get_block8[] = {
+  0xC503, 0x0005,  // lbu    a0, 0(a1)                  ; a0 = *(uint8_t *)a1
+  0xC603, 0x0015,  // lbu    a2, 1(a1)                  ; a2 = *(uint8_t *)(a1+1)
+  0x0622,          // c.slli a2, 8                      ; a2 <<= 8
+  0x8D51,          // c.or   a0, a2                     ; a0 |= a2
+  0xC603, 0x0025,  // lbu    a2, 2(a1)                  ; a2 = *(uint8_t *)(a1+2)
+  0x0642,          // c.slli a2, 16                     ; a2 <<= 16
+  0x8D51,          // c.or   a0, a2                     ; a0 |= a2
+  0xC603, 0x0035,  // lbu    a2, 3(a1)                  ; a2 = *(uint8_t *)(a1+3)
+  0x0662,          // c.slli a2, 24                     ; a2 <<= 24
+  0x8D51,          // c.or   a0, a2                     ; a0 |= a2
+  0xC008,          // c.sw   a0, 0(s0)                  ; *s0 = a0      (DATA0)
+  0x0591           // c.addi a1, 4                      ; a1 += 4
+};
 
+_Static_assert(!(sizeof(stub_get_block8) & 3) && sizeof(stub_get_block8) <= CTX_PROG_BYTES, "stub_get_block8");
 
-static uint16_t stub_set_block[] = {
-  0x0437, 0xE000,  // lui    s0, DM_DATA_BASE[31:12]
-  0x0413, 0xFFFF,  // addi   s0, s0, DM_DATA_ADDR[11:0] ; s0 = 0xE00000F4
+//------------------------------------------------------------------------------
+
+static uint16_t stub_set_block8[] = {
   0x4008,          // c.lw   a0, 0(s0)                  ; a0 = *s0      (DATA0)
-  0x404C,          // c.lw   a1, 4(s0)                  ; a1 = *(s0+4)  (DATA1)
-  0xC188,          // c.sw   a0, 0(a1)                  ; *a1 = a0
+  0x8023, 0x00A5,  // sb     a0, 0(a1)                  ; *(uint8_t *)a1 = a0
+  0x8121,          // c.srli a0, 8                      ; a0 >>= 8
+  0x80A3, 0x00A5,  // sb     a0, 1(a1)                  ; *(uint8_t *)(a1+1) = a0
+  0x8121,          // c.srli a0, 8                      ; a0 >>= 8
+  0x8123, 0x00A5,  // sb     a0, 2(a1)                  ; *(uint8_t *)(a1+2) = a0
+  0x8121,          // c.srli a0, 8                      ; a0 >>= 8
+  0x81A3, 0x00A5,  // sb     a0, 3(a1)                  ; *(uint8_t *)(a1+3) = a0
+  0x0591,          // c.addi a1, 4                      ; a1 += 4
+  0x9002           // c.ebreak
+};
+
+_Static_assert(!(sizeof(stub_set_block8) & 3) && sizeof(stub_set_block8) <= CTX_PROG_BYTES, "stub_set_block8");
+
+//------------------------------------------------------------------------------
+
+static uint16_t stub_get_block16[] = {
+  0xD503, 0x0005,  // lhu    a0, 0(a1)                  ; a0 = *(uint16_t *)a1
+  0xD603, 0x0025,  // lhu    a2, 2(a1)                  ; a2 = *(uint16_t *)(a1+2)
+  0x0642,          // c.slli a2, 16                     ; a2 <<= 16
+  0x8D51,          // c.or   a0, a2                     ; a0 |= a2
+  0xC008,          // c.sw   a0, 0(s0)                  ; *s0 = a0      (DATA0)
+  0x0591,          // c.addi a1, 4                      ; a1 += 4
+  0x9002,          // c.ebreak
+  0x0001           // c.nop
+};
+
+_Static_assert(!(sizeof(stub_get_block16) & 3) && sizeof(stub_get_block16) <= CTX_PROG_BYTES, "stub_get_block16");
+
+//------------------------------------------------------------------------------
+
+static uint16_t stub_set_block16[] = {
+  0x4008,          // c.lw   a0, 0(s0)                  ; a0 = *s0      (DATA0)
+  0x9023, 0x00A5,  // sh     a0, 0(a1)                  ; *(uint16_t *)a1 = a0
+  0x8141,          // c.srli a0, 16                     ; a0 >>= 16
+  0x9123, 0x00A5,  // sh     a0, 2(a1)                  ; *(uint16_t *)(a1+2) = a0
+  0x0591,          // c.addi a1, 4                      ; a1 += 4
+  0x9002           // c.ebreak
+};
+
+_Static_assert(!(sizeof(stub_set_block16) & 3) && sizeof(stub_set_block16) <= CTX_PROG_BYTES, "stub_set_block16");
+
+//------------------------------------------------------------------------------
+// One item per execution for what doesn't fill a word.
+
+static uint16_t stub_get8[] = {
+  0xC503, 0x0005,  // lbu    a0, 0(a1)                  ; a0 = *(uint8_t *)a1
+  0xC008,          // c.sw   a0, 0(s0)                  ; *s0 = a0      (DATA0)
+  0x0585,          // c.addi a1, 1                      ; a1 += 1
+  0x9002,          // c.ebreak
+  0x0001           // c.nop
+};
+
+static uint16_t stub_get16[] = {
+  0xD503, 0x0005,  // lhu    a0, 0(a1)                  ; a0 = *(uint16_t *)a1
+  0xC008,          // c.sw   a0, 0(s0)                  ; *s0 = a0      (DATA0)
+  0x0589,          // c.addi a1, 2                      ; a1 += 2
+  0x9002,          // c.ebreak
+  0x0001           // c.nop
+};
+
+static uint16_t stub_set8[] = {
+  0x4008,          // c.lw   a0, 0(s0)                  ; a0 = *s0      (DATA0)
+  0x8023, 0x00A5,  // sb     a0, 0(a1)                  ; *(uint8_t *)a1 = a0
+  0x0585,          // c.addi a1, 1                      ; a1 += 1
+  0x9002,          // c.ebreak
+  0x0001           // c.nop
+};
+
+static uint16_t stub_set16[] = {
+  0x4008,          // c.lw   a0, 0(s0)                  ; a0 = *s0      (DATA0)
+  0x9023, 0x00A5,  // sh     a0, 0(a1)                  ; *(uint16_t *)a1 = a0
+  0x0589,          // c.addi a1, 2                      ; a1 += 2
+  0x9002,          // c.ebreak
+  0x0001           // c.nop
+};
+
+_Static_assert(!(sizeof(stub_get8) & 3) && sizeof(stub_get8) <= CTX_PROG_BYTES, "stub_get8");
+_Static_assert(!(sizeof(stub_get16) & 3) && sizeof(stub_get16) <= CTX_PROG_BYTES, "stub_get16");
+_Static_assert(!(sizeof(stub_set8) & 3) && sizeof(stub_set8) <= CTX_PROG_BYTES, "stub_set8");
+_Static_assert(!(sizeof(stub_set16) & 3) && sizeof(stub_set16) <= CTX_PROG_BYTES, "stub_set16");
+
+//------------------------------------------------------------------------------
+// CRC-32 of [a1, DATA0) one word at a time, bit by bit. a0 carries the CRC
+// between runs and ends up in DATA0, a3 = CRC32_POLY, s0 = DM_DATA_ADDR.
+
+static uint16_t stub_crc32[] = {
+  0x4010,          // c.lw   a2, 0(s0)                  ; a2 = *s0      (DATA0) end
+                // word:
+  0x4198,          // c.lw   a4, 0(a1)                  ; a4 = *a1
+  0x8D39,          // c.xor  a0, a4                     ; a0 ^= a4
+  0x0591,          // c.addi a1, 4                      ; a1 += 4
+  0x5781,          // c.li   a5, -32                    ; a5 = -32      bit count
+                // bit:
+  0x872A,          // c.mv   a4, a0                     ; a4 = a0
+  0x8B05,          // c.andi a4, 1                      ; a4 &= 1
+  0x8105,          // c.srli a0, 1                      ; a0 >>= 1
+  0xC311,          // c.beqz a4, skip                   ; If a4 == 0 -> goto skip
+  0x8D35,          // c.xor  a0, a3                     ; a0 ^= a3
+                // skip:
+  0x0785,          // c.addi a5, 1                      ; a5++
+  0xFBF5,          // c.bnez a5, bit                    ; If a5 -> goto bit
+  0x95E3, 0xFEC5,  // bne    a1, a2, word               ; If a1 != a2 -> goto word
+  0xC008,          // c.sw   a0, 0(s0)                  ; *s0 = a0      (DATA0)
+  0x0001           // c.nop
+};
+
+_Static_assert(!(sizeof(stub_crc32) & 3) && sizeof(stub_crc32) <= CTX_PROG_BYTES, "stub_crc32");
+
+//------------------------------------------------------------------------------
+// Memory agent, like stub_crc32 every run goes from a1 up to the end address
+// in DATA0. Fill and compare end in c.ebreak, see stub_get_block8. Fill:
+// a5 = pattern.
+
+static uint16_t stub_fill[] = {
+  0x4010,          // c.lw   a2, 0(s0)                  ; a2 = *s0      (DATA0) end
+                // loop:
+  0xC19C,          // c.sw   a5, 0(a1)                  ; *a1 = a5
   0x0591,          // c.addi a1, 4                      ; a1 += 4
-  0xC04C,          // c.sw   a1, 4(s0)                  ; *(s0+4) = a1  (DATA1)
+  0x9EE3, 0xFEC5,  // bne    a1, a2, loop               ; If a1 != a2 -> goto loop
   0x9002           // c.ebreak
 };
 
-_Static_assert(!(sizeof(stub_set_block) & 3), "stub_set_block");
+_Static_assert(!(sizeof(stub_fill) & 3) && sizeof(stub_fill) <= CTX_PROG_BYTES, "stub_fill");
+
+//------------------------------------------------------------------------------
+// Compare [a1, end) with a3, DATA0 = first differing word or end.
+
+static uint16_t stub_compare[] = {
+  0x4010,          // c.lw   a2, 0(s0)                  ; a2 = *s0      (DATA0) end
+                // loop:
+  0x4188,          // c.lw   a0, 0(a1)                  ; a0 = *a1
+  0x4298,          // c.lw   a4, 0(a3)                  ; a4 = *a3
+  0x1663, 0x00E5,  // bne    a0, a4, diff               ; If a0 != a4 -> goto diff
+  0x0591,          // c.addi a1, 4                      ; a1 += 4
+  0x0691,          // c.addi a3, 4                      ; a3 += 4
+  0x9AE3, 0xFEC5,  // bne    a1, a2, loop               ; If a1 != a2 -> goto loop
+                // diff:
+  0xC00C,          // c.sw   a1, 0(s0)                  ; *s0 = a1      (DATA0)
+  0x9002,          // c.ebreak
+  0x0001           // c.nop
+};
+
+_Static_assert(!(sizeof(stub_compare) & 3) && sizeof(stub_compare) <= CTX_PROG_BYTES, "stub_compare");
+
+//------------------------------------------------------------------------------
+// Search: a0 is a window of the last 4 bytes, the newest one on top, a3 masks
+// the bytes to compare and a5 holds them. DATA0 = a1 right past the match or
+// end, DATA1 = the masked window, which equals a5 only on a match.
+
+static uint16_t stub_find[] = {
+  0x4010,          // c.lw   a2, 0(s0)                  ; a2 = *s0      (DATA0) end
+                // loop:
+  0xC703, 0x0005,  // lbu    a4, 0(a1)                  ; a4 = *(uint8_t *)a1
+  0x8121,          // c.srli a0, 8                      ; a0 >>= 8
+  0x0762,          // c.slli a4, 24                     ; a4 <<= 24
+  0x8D59,          // c.or   a0, a4                     ; a0 |= a4
+  0x0585,          // c.addi a1, 1                      ; a1 += 1
+  0x872A,          // c.mv   a4, a0                     ; a4 = a0
+  0x8F75,          // c.and  a4, a3                     ; a4 &= a3
+  0x0463, 0x00F7,  // beq    a4, a5, found              ; If a4 == a5 -> goto found
+  0x96E3, 0xFEC5,  // bne    a1, a2, loop               ; If a1 != a2 -> goto loop
+                // found:
+  0xC00C,          // c.sw   a1, 0(s0)                  ; *s0 = a1      (DATA0)
+  0xC058,          // c.sw   a4, 4(s0)                  ; *(s0+4) = a4  (DATA1)
+  0x0001           // c.nop
+};
+
+_Static_assert(!(sizeof(stub_find) & 3) && sizeof(stub_find) <= CTX_PROG_BYTES, "stub_find");
 
 //------------------------------------------------------------------------------
 // NOTE: We can NOT save registers here, as doing so would clobber DATA0 which
@@ -389,6 +602,97 @@ result:
   }
 }
 
+//------------------------------------------------------------------------------
+// Short stubs run right after stub_mem, which fills the whole progbuf, so any
+// that misses its ebreak runs into the words left behind.
+
+static void test_narrow_blocks(uint32_t base) {
+  print_b(0, "8/16-bit blocks\n");
+
+  for (int width = 1; width <= 2; width++) {
+    bool result = false;
+    printf("  width: %d", width);
+
+    // 7 items = packed words and single item tail
+    size_t size = 7 * width;
+    uint16_t data16[7], buf16[7];
+    uint8_t *data = (uint8_t *)data16;
+    uint8_t *buf = (uint8_t *)buf16;
+    for (size_t i = 0; i < size; i++)
+      data[i] = 0x11 * (i + 1);
+    memset(buf16, 0xFF, sizeof(buf16));
+
+    if (!test_write_const(base, 16))                                goto result;
+
+    ctx_load_prog((uint32_t *)stub_mem, sizeof(stub_mem) / 4);
+    if (width == 1) {
+      if (!ctx_set_block8(base, data, size))                        goto result;
+      ctx_load_prog((uint32_t *)stub_mem, sizeof(stub_mem) / 4);
+      if (!ctx_get_block8(base, buf, size))                         goto result;
+    } else {
+      if (!ctx_set_block16(base, data16, size / 2))                 goto result;
+      ctx_load_prog((uint32_t *)stub_mem, sizeof(stub_mem) / 4);
+      if (!ctx_get_block16(base, buf16, size / 2))                  goto result;
+    }
+
+    if (memcmp(buf, data, size))                                    goto result;
+    if (!test_read_const(base + size, 16 - size))                   goto result;
+
+    result = true;
+
+result:
+    print_status(result);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Fill, compare and find right after stub_find, which fills the whole progbuf.
+
+static const uint8_t test_patterns[][7] = {
+  // length, pattern
+  { 2, 0x5A, 0xA5 },
+  { 6, 0x5A, 0xA5, 0xA5, 0xA5, 0xA5, 0xA5 },
+  { 2, 0xA5, 0x5A }
+};
+
+static const uint8_t test_found[] = { 80, 80, 90 };
+
+static void test_agent(uint32_t base) {
+  print_b(0, "memory agent\n");
+
+  bool result = false;
+  uint32_t found;
+  ctx_load_prog((uint32_t *)stub_find, sizeof(stub_find) / 4);
+
+  // 0x5A everywhere but 81..90, that part has an unaligned head and tail
+  if (!ctx_fill(base, 128, 0x5A))                                   goto result;
+  if (!ctx_fill(base + 81, 10, 0xA5))                               goto result;
+
+  uint8_t buf[16];
+  if (!ctx_read(base + 80, buf, sizeof(buf)))                       goto result;
+  for (size_t i = 0; i < sizeof(buf); i++)
+    if (buf[i] != (i >= 1 && i <= 10 ? 0xA5 : 0x5A))                goto result;
+
+  ctx_load_prog((uint32_t *)stub_find, sizeof(stub_find) / 4);
+  uint32_t offset;
+  if (!ctx_compare(base, base + 32, 32, &offset) || offset != 32)   goto result;
+  if (!ctx_compare(base, base + 64, 64, &offset) || offset != 16)   goto result;
+
+  for (size_t i = 0; i < count_of(test_patterns); i++) {
+    const uint8_t *p = test_patterns[i];
+    if (ctx_find(base, 128, p + 1, p[0], &found) != 1)              goto result;
+    if (found != base + test_found[i])                              goto result;
+  }
+
+  static const uint8_t missing[] = { 0x11 };
+  if (ctx_find(base, 128, missing, 1, &found))                      goto result;
+
+  result = true;
+
+result:
+  print_status(result);
+}
+
 //------------------------------------------------------------------------------
 
 static void test_block(uint32_t addr, bool expected) {
@@ -469,6 +773,8 @@ void ctx_test(void) {
   test_misaligned_writes(addr);
   test_aligned_block_reads(addr);
   test_aligned_block_writes(addr);
+  test_narrow_blocks(addr);
+  test_agent(addr);
 
   // Test block writes at both ends of memory
   print_b(0, "block writes at both ends of memory\n");
@@ -489,6 +795,27 @@ void ctx_test(void) {
 //==============================================================================
 // API
 
+// Probed once per attach: -1 = not probed yet, 0 = not supported, 1 = supported
+static int8_t gpr_stream = -1;  // See "Register file"
+static int8_t aam = -1;         // See "Memory access - abstract commands"
+
+// See "Register snapshot"
+static struct {
+  uint32_t regs[CTX_REG_MAX];
+  uint64_t valid;  // Bit masks of regs
+  uint64_t dirty;
+} snap;
+
+static bool misa_valid;  // gpr_max is read once per attach
+
+static bool snap_write_back(void);
+
+// Registers may change once the hart runs, DCSR is ours
+static inline void snap_invalidate(void) {
+  snap.valid &= 1ull << CTX_REG_DCSR;
+  snap.dirty = 0;
+}
+
 void ctx_init(void) {
   // GPRs
   gpr_saved = 0;
@@ -497,14 +824,23 @@ void ctx_init(void) {
   // Progbuf
   dm_abstractcs abstractcs = dm_get_abstractcs();
   prog_cache_init(abstractcs.b.PROGBUFSIZE);
+
+  // Register file
+  gpr_stream = -1;
+  misa_valid = false;
+  snap.valid = 0;
+  snap.dirty = 0;
+
+  // Memory
+  aam = -1;
+  ctx_cache_flush();
+  ctx_mirror_flush();
 }
 
 //------------------------------------------------------------------------------
 
 inline void ctx_set_stub_opcode(uint16_t opcode) {
-  stub_mem32[3] = opcode;
-  stub_get_block[3] = opcode;
-  stub_set_block[3] = opcode;
+  stub_mem[3] = opcode;
 }
 
 //------------------------------------------------------------------------------
@@ -548,6 +884,7 @@ void ctx_dump(void) {
 
   gpr_cache_dump();
   prog_cache_dump();
+  print_str(0, "memory access", aam < 0 ? "not probed" : aam ? "abstract command" : "progbuf stub");
 
   dm_abstractauto abstractauto = dm_get_abstractauto();
   dm_abstractcs abstractcs = dm_get_abstractcs();
@@ -607,38 +944,68 @@ inline bool ctx_halted(const char *msg) {
 //------------------------------------------------------------------------------
 
 bool ctx_halt(void) {
-  if (!swio_halt())
-    return false;
+  // The hart was running, memory and registers may have changed
+  ctx_cache_flush();
+  snap_invalidate();
 
-  // GPR
-  csr_misa misa;
-  if (!csr_get_misa(&misa))
+  bool reset;
+  if (!swio_halt(&reset))
     return false;
 
-  gpr_max = csr_misa_rv(misa);
+  // A reset we didn't cause cleared DCSR, the shadow is stale
+  if (reset)
+    snap.valid &= ~(1ull << CTX_REG_DCSR);
+
+  // GPR count, MISA doesn't change until the next attach
+  if (!misa_valid) {
+    csr_misa misa;
+    if (!csr_get_misa(&misa))
+      return false;
+
+    gpr_max = csr_misa_rv(misa);
+    misa_valid = true;
+  }
 
   // Turn on debug breakpoints & stop counters/timers during debug
-  csr_dcsr dcsr;
-  if (!csr_get_dcsr(&dcsr))
+  uint32_t dcsr;
+  if (!ctx_get_reg(CTX_REG_DCSR, &dcsr))
+    return false;
+
+  uint32_t want = dcsr | DCSR_STOPTIME | DCSR_EBREAKM;
+  if (want == dcsr)
+    return true;
+
+  if (!csr_set_dcsr(want))
     return false;
 
-  return csr_set_dcsr(dcsr.raw | DCSR_STOPTIME | DCSR_EBREAKM);
+  snap.regs[CTX_REG_DCSR] = want;
+  return true;
 }
 
 //------------------------------------------------------------------------------
 
 bool ctx_resume(bool step) {
-  csr_dcsr dcsr;
-  if (!csr_get_dcsr(&dcsr))
+  // Consecutive steps leave DCSR alone
+  uint32_t dcsr;
+  if (!ctx_get_reg(CTX_REG_DCSR, &dcsr))
     return false;
 
-  dcsr.b.STEP = step;
-  if (!csr_set_dcsr(dcsr.raw))
-    return false;
+  uint32_t want = step ? dcsr | DCSR_STEP : dcsr & ~DCSR_STEP;
+  if (want != dcsr) {
+    if (!csr_set_dcsr(want))
+      return false;
+    snap.regs[CTX_REG_DCSR] = want;
+  }
 
-  if (!gpr_cache_restore())
+  // Registers written while halted go after the restore of clobbered ones,
+  // those don't need restoring
+  gpr_saved &= ~(uint32_t)snap.dirty;
+  if (!gpr_cache_restore() || !snap_write_back())
     return false;
 
+  ctx_cache_flush();
+  snap_invalidate();
+
   if (step)
     return swio_step();
   return swio_resume();
@@ -669,7 +1036,7 @@ bool ctx_read_reg(uint16_t regno, uint32_t *value) {
     return false;
 
   *value = dm_get_data0();
-  return true;
+  return swio_link_ok();
 }
 
 //------------------------------------------------------------------------------
@@ -688,298 +1055,1846 @@ bool ctx_write_reg(uint16_t regno, uint32_t value) {
 }
 
 //==============================================================================
-// Memory access - GET
+// Register file
+//
+// An access register command with AARPOSTINC advances regno after every
+// transfer, so with autoexec on DATA0 the whole register file streams through
+// DATA0 in one batch. Support is probed once per attach, per register
+// commands are the fallback.
 
-bool ctx_get_mem32(uint32_t addr, uint32_t* data) {
-  uint32_t data_lo;
-  uint32_t addr_lo = addr & ~3;
-  if (!ctx_get_mem32_aligned(addr_lo, &data_lo))
-    return false;
+#if CTX_GPR_STREAM
 
-  uint8_t offset = addr & 3;
-  if (offset == 0) {
-    *data = data_lo;
-    return true;
-  }
+//------------------------------------------------------------------------------
 
-  uint32_t data_hi;
-  if (!ctx_get_mem32_aligned(addr_lo + 4, &data_hi))
+static bool gpr_stream_get(uint8_t regno, uint32_t *regs, size_t count) {
+  dm_abstractcs_clear_err();
+  dm_set_command(DMCM_GPR | regno | DMCM_TRANSFER | DMCM_AARSIZE(32) | DMCM_AARPOSTINC);
+  if (!dm_abstractcs_wait())
     return false;
 
-  offset *= 8;
-  data_lo >>= offset;
-  data_hi <<= 32 - offset;
+  // Read registers using auto-execution, each read kicks the next one
+  dm_set_abstractauto(DMAA_DATA0);
+  bool ret = dm_get_data0_stream(regs, count - 1);
 
-  *data = data_lo | data_hi;
+  // Disable auto-execution before reading the last register
+  dm_set_abstractauto(0);
+  if (!ret)
+    return false;
+
+  regs[count - 1] = dm_get_data0();
   return true;
 }
 
 //------------------------------------------------------------------------------
 
-bool ctx_get_mem16(uint32_t addr, uint16_t *data) {
-  uint32_t data_lo;
-  uint32_t addr_lo = addr & ~3;
-  if (!ctx_get_mem32_aligned(addr_lo, &data_lo))
+static bool gpr_stream_set(uint8_t regno, const uint32_t *regs, size_t count) {
+  dm_abstractcs_clear_err();
+  dm_set_data0(regs[0]);
+  dm_set_command(DMCM_GPR | regno | DMCM_WRITE | DMCM_TRANSFER | DMCM_AARSIZE(32) |
+                 DMCM_AARPOSTINC);
+  if (!dm_abstractcs_wait())
     return false;
 
-  uint8_t offset = addr & 3;
-  if (offset < 3) {
-    offset *= 8;
-    data_lo >>= offset;
+  // Write registers using auto-execution
+  dm_set_abstractauto(DMAA_DATA0);
+  bool ret = dm_put_data0_stream(regs + 1, count - 1);
 
-    *data = data_lo;
-    return true;
-  }
+  // Disable auto-execution
+  dm_set_abstractauto(0);
+  return ret;
+}
 
-  data_lo >>= 24;
+//------------------------------------------------------------------------------
+// Load S0/S1 with known values and stream them back.
 
-  uint32_t data_hi;
-  if (!ctx_get_mem32_aligned(addr_lo + 4, &data_hi))
-    return false;
+static bool gpr_stream_probe(void) {
+  static const uint32_t pattern[2] = { 0x5A5A0008, 0xA5A50009 };
 
-  data_hi <<= 8;
+  if (!gpr_cache_save(GPRB(S0) | GPRB(S1)) ||
+      !gpr_set(GPR_S0, pattern[0]) || !gpr_set(GPR_S1, pattern[1]))
+    return false;  // Try again next time
 
-  *data = data_lo | data_hi;
+  uint32_t regs[2];
+  gpr_stream = gpr_stream_get(GPR_S0, regs, 2) &&
+               regs[0] == pattern[0] && regs[1] == pattern[1];
+
+  if (!gpr_stream)
+    dm_abstractcs_clear_err();
   return true;
 }
 
+#endif  // CTX_GPR_STREAM
+
 //------------------------------------------------------------------------------
+// Registers clobbered by our stubs are reported from the GPR cache.
 
-bool ctx_get_mem8(uint32_t addr, uint8_t *data) {
-  uint32_t data_lo;
-  if (!ctx_get_mem32_aligned(addr & ~3, &data_lo))
+static bool gpr_file_get(uint32_t *regs) {
+#if CTX_GPR_STREAM
+  if (gpr_stream < 0 && !gpr_stream_probe())
     return false;
 
-  uint8_t offset = (addr & 3) * 8;
-  *data = data_lo >> offset;
+  if (gpr_stream) {
+    if (!gpr_stream_get(GPR_ZERO, regs, gpr_max))
+      return false;
+  } else
+#endif
+  for (uint8_t i = 0; i < gpr_max; i++) {
+    if (!gpr_get(i, &regs[i]))
+      return false;
+  }
+
+  for (uint8_t i = 0; i < gpr_max; i++) {
+    if (gpr_saved & (1u << i))
+      regs[i] = gpr_cache[i];
+  }
   return true;
 }
 
-//==============================================================================
-// Memory access - SET
+//------------------------------------------------------------------------------
 
-bool ctx_set_mem32(uint32_t addr, uint32_t data) {
-  uint8_t offset = addr & 3;
-  if (offset == 0)
-    return ctx_set_mem32_aligned(addr, data);
+static bool gpr_file_set(const uint32_t *regs) {
+  bool ret = true;
 
-  uint32_t data_lo;
-  uint32_t addr_lo = addr & ~3;
-  if (!ctx_get_mem32_aligned(addr_lo, &data_lo))
+#if CTX_GPR_STREAM
+  if (gpr_stream < 0 && !gpr_stream_probe())
     return false;
 
-  uint32_t data_hi;
-  uint32_t addr_hi = addr_lo + 4;
-  if (!ctx_get_mem32_aligned(addr_hi, &data_hi))
-    return false;
+  // x0 is hardwired to zero
+  if (gpr_stream)
+    ret = gpr_stream_set(GPR_RA, regs + 1, gpr_max - 1);
+  else
+#endif
+  for (uint8_t i = 1; i < gpr_max && ret; i++)
+    ret = gpr_set(i, regs[i]);
 
-  switch (offset) {
-    case 1:
-      data_lo &= 0x000000FF;
-      data_lo |= data << 8;
-      data_hi &= 0xFFFFFF00;
-      data_hi |= data >> 24;  // 8+24=32
-      break;
-    case 2:
-      data_lo &= 0x0000FFFF;
-      data_lo |= data << 16;
-      data_hi &= 0xFFFF0000;
-      data_hi |= data >> 16;  // 16+16=32
-      break;
-    default:
-      data_lo &= 0x00FFFFFF;
-      data_lo |= data << 24;
-      data_hi &= 0xFF000000;
-      data_hi |= data >> 8;   // 24+8=32
+  return ret;
+}
+
+//==============================================================================
+// Register snapshot
+//
+// Nothing changes the registers while the hart is halted, so each register is
+// read once per halt and later reads are served from here. Writes only mark
+// the register dirty, ctx_resume writes them back after the GPR cache restore.
+// DCSR holds the value we last wrote and survives halts, only a reset drops it
+// (ctx_reset, or one ctx_halt finds in DM_STATUS).
+// The hart updates CAUSE on every halt, which we never write back, and PRV,
+// which stays machine mode on the QingKe V2.
+
+#define SNAP_GPRS  (((1ull << gpr_max) - 1) & ~1ull)  // x0 is hardwired
+
+//------------------------------------------------------------------------------
+
+static bool snap_read(uint8_t regno, uint32_t *value) {
+  if (regno < 32) {
+    if (gpr_saved & (1u << regno)) {
+      *value = gpr_cache[regno];
+      return true;
+    }
+    return gpr_get(regno, value);
   }
 
-  return ctx_set_mem32_aligned(addr_lo, data_lo) &&
-         ctx_set_mem32_aligned(addr_hi, data_hi);
+  switch (regno) {
+    case CTX_REG_PC:      return csr_get_dpc(value);
+    case CTX_REG_DCSR:    return csr_get(CSR_DCSR, value);
+    case CTX_REG_MSTATUS: return csr_get(CSR_MSTATUS, value);
+  }
+  return false;
 }
 
 //------------------------------------------------------------------------------
 
-bool ctx_set_mem16(uint32_t addr, uint16_t data) {
-  uint32_t data_lo;
-  uint32_t addr_lo = addr & ~3;
-  if (!ctx_get_mem32_aligned(addr_lo, &data_lo))
-    return false;
+static bool snap_write_back(void) {
+  if (!snap.dirty)
+    return true;
 
-  uint32_t offset = addr & 3;
-  switch (offset) {
-    case 0:
-      data_lo &= 0xFFFF0000;
-      data_lo |= data;
-      break;
-    case 1:
-      data_lo &= 0xFF0000FF;
-      data_lo |= (uint32_t)data << 8;
-      break;
-    case 2:
-      data_lo &= 0x0000FFFF;
-      data_lo |= (uint32_t)data << 16;
-      break;
-    default:
-      data_lo &= 0x00FFFFFF;
-      data_lo |= (uint32_t)data << 24;
+  // A G packet dirties the whole register file, stream it
+  if ((snap.dirty & SNAP_GPRS) == SNAP_GPRS) {
+    if (!gpr_file_set(snap.regs))
+      return false;
+    snap.dirty &= ~SNAP_GPRS;
   }
 
-  if (!ctx_set_mem32_aligned(addr_lo, data_lo))
+  for (uint8_t i = 1; i < gpr_max; i++) {
+    if ((snap.dirty & (1ull << i)) && !gpr_set(i, snap.regs[i]))
+      return false;
+  }
+
+  if ((snap.dirty & (1ull << CTX_REG_PC)) && !csr_set_dpc(snap.regs[CTX_REG_PC]))
+    return false;
+  if ((snap.dirty & (1ull << CTX_REG_MSTATUS)) && !csr_set_mstatus(snap.regs[CTX_REG_MSTATUS]))
     return false;
 
-  if (offset != 3)
-    return true;
+  snap.dirty = 0;
+  return true;
+}
 
-  uint32_t data_hi;
-  uint32_t addr_hi = addr_lo + 4;
-  if (!ctx_get_mem32_aligned(addr_hi, &data_hi))
+//------------------------------------------------------------------------------
+
+bool ctx_get_reg(uint8_t regno, uint32_t *value) {
+  if (regno >= CTX_REG_MAX)
     return false;
 
-  data_hi &= 0xFFFFFF00;
-  data_hi |= HIBYTE(data);
-  return ctx_set_mem32_aligned(addr_hi, data_hi);
+  if (!(snap.valid & (1ull << regno))) {
+    if (!snap_read(regno, &snap.regs[regno]))
+      return false;
+    snap.valid |= 1ull << regno;
+  }
+
+  *value = snap.regs[regno];
+  return true;
 }
 
 //------------------------------------------------------------------------------
+// DCSR is written by ctx_halt/ctx_resume only.
 
-bool ctx_set_mem8(uint32_t addr, uint8_t data) {
-  uint32_t data_lo;
-  uint32_t addr_lo = addr & ~3;
-  if (!ctx_get_mem32_aligned(addr_lo, &data_lo))
+bool ctx_set_reg(uint8_t regno, uint32_t value) {
+  if (regno >= CTX_REG_MAX || regno == CTX_REG_DCSR)
     return false;
 
-  switch (addr & 3) {
-    case 0:
-      data_lo &= 0xFFFFFF00;
-      data_lo |= data;
-      break;
-    case 1:
-      data_lo &= 0xFFFF00FF;
-      data_lo |= (uint32_t)data << 8;
-      break;
-    case 2:
-      data_lo &= 0xFF00FFFF;
-      data_lo |= (uint32_t)data << 16;
-      break;
-    default:
-      data_lo &= 0x00FFFFFF;
-      data_lo |= (uint32_t)data << 24;
+  if (regno != GPR_ZERO) {
+    snap.regs[regno] = value;
+    snap.valid |= 1ull << regno;
+    snap.dirty |= 1ull << regno;
   }
+  return true;
+}
 
-  return ctx_set_mem32_aligned(addr_lo, data_lo);
+//------------------------------------------------------------------------------
+
+bool ctx_get_gprs(uint32_t *regs) {
+  uint64_t missing = ~snap.valid & (SNAP_GPRS | 1);
+  if (missing) {
+    uint32_t file[32];
+    if (!gpr_file_get(file))
+      return false;
+
+    for (uint8_t i = 0; i < gpr_max; i++) {
+      if (missing & (1ull << i))
+        snap.regs[i] = file[i];
+    }
+    snap.valid |= missing;
+  }
+
+  memcpy(regs, snap.regs, gpr_max * 4);
+  return true;
 }
 
 //------------------------------------------------------------------------------
 
-bool ctx_get_mem32_aligned(uint32_t addr, uint32_t *data) {
-#if PROG_DUMP
-  print_c("get mem32: %08X\n", addr);
+bool ctx_set_gprs(const uint32_t *regs) {
+  for (uint8_t i = 1; i < gpr_max; i++)
+    ctx_set_reg(i, regs[i]);
+  return true;
+}
+
+//==============================================================================
+// Memory cache
+//
+// Reads are served from 32 byte lines while the hart stays halted, writes go
+// through to the target and update the lines already present. Anything that
+// may change memory behind our back (halt, resume, reset, flash and option
+// byte programming) flushes the whole cache.
+
+#define CACHE_LINE_WORDS  8
+#define CACHE_LINE_SIZE   (CACHE_LINE_WORDS * 4)
+#define CACHE_LINES       32
+#define CACHE_RANGES      4
+#define CACHE_INVALID     1  // Lines are aligned, so never a valid line address
+
+typedef struct {
+  uint32_t addr;
+  uint32_t data[CACHE_LINE_WORDS];
+} cache_line;
+
+typedef struct {
+  uint32_t start;
+  uint32_t end;  // Inclusive
+} cache_range;
+
+#if MEM_CACHE
+static cache_line cache[CACHE_LINES];
 #endif
 
-  ctx_load_prog((uint32_t *)stub_mem32, sizeof(stub_mem32) / 4);
-  if (!gpr_cache_save(GPRB(S0) | GPRB(A0)))
-    return false;
+static cache_range cache_uncached[CACHE_RANGES] = {
+  { CTX_PERIPH_ADDR, 0xFFFFFFFF }
+};
 
-  // Set LSB to 0 to indicate read operation
-  dm_set_data1(addr);
-  if (!ctx_exec_prog("get mem32"))
+static uint8_t cache_ranges = 1;
+static uint32_t cache_hits;
+static uint32_t cache_misses;
+
+static bool mem_get_block(uint32_t addr, uint32_t *data, size_t count);
+
+//------------------------------------------------------------------------------
+
+void ctx_cache_flush(void) {
+#if MEM_CACHE
+  for (size_t i = 0; i < CACHE_LINES; i++)
+    cache[i].addr = CACHE_INVALID;
+#endif
+}
+
+//------------------------------------------------------------------------------
+
+bool ctx_cache_uncached(uint32_t start, uint32_t end) {
+  if (cache_ranges == CACHE_RANGES) {
+    print_r(2, "cache: too many uncached ranges\n");
     return false;
+  }
 
-  *data = dm_get_data0();
+  cache_range *r = &cache_uncached[cache_ranges++];
+  r->start = start;
+  r->end = end;
+
+  // Drop lines that are not cacheable anymore
+  ctx_cache_flush();
   return true;
 }
 
 //------------------------------------------------------------------------------
 
-bool ctx_set_mem32_aligned(uint32_t addr, uint32_t data) {
-#if PROG_DUMP
-  print_c("set mem32: addr=%08X\n", addr);
+void ctx_cache_dump(void) {
+  print_y(0, "cache:info\n");
+
+  uint32_t total = cache_hits + cache_misses;
+  print_b(2, "reads");
+  printf(": hits %d  misses %d", cache_hits, cache_misses);
+  if (total)
+    printf("  (%d%%)", cache_hits * 100 / total);
+  putchar('\n');
+
+#if MEM_CACHE
+  uint8_t valid = 0;
+  for (size_t i = 0; i < CACHE_LINES; i++) {
+    if (cache[i].addr != CACHE_INVALID)
+      valid++;
+  }
+
+  print_b(2, "lines");
+  printf(": %d/%d x %d bytes\n", valid, CACHE_LINES, CACHE_LINE_SIZE);
 #endif
 
-  ctx_load_prog((uint32_t *)stub_mem32, sizeof(stub_mem32) / 4);
-  if (!gpr_cache_save(GPRB(S0) | GPRB(A0)))
-    return false;
+  print_b(2, "uncached");
+  for (size_t i = 0; i < cache_ranges; i++)
+    printf("  %08X-%08X", cache_uncached[i].start, cache_uncached[i].end);
+  putchar('\n');
 
-  // Set LSB to 1 to indicate write operation
-  dm_set_data1(addr | 1);
-  dm_set_data0(data);
+  ctx_mirror_dump();
+}
 
-  return ctx_exec_prog("set mem32");
+#if MEM_CACHE
+
+//------------------------------------------------------------------------------
+
+static bool cache_cacheable(uint32_t base) {
+  uint32_t last = base + CACHE_LINE_SIZE - 1;
+
+  for (size_t i = 0; i < cache_ranges; i++) {
+    const cache_range *r = &cache_uncached[i];
+    if (base <= r->end && last >= r->start)
+      return false;
+  }
+  return true;
+}
+
+//------------------------------------------------------------------------------
+
+static inline cache_line *cache_slot(uint32_t base) {
+  return &cache[(base / CACHE_LINE_SIZE) % CACHE_LINES];
+}
+
+//------------------------------------------------------------------------------
+// Returns the line holding addr, filling it on a miss. NULL if addr is not
+// cacheable or the fill failed.
+
+static cache_line *cache_get_line(uint32_t addr, bool *ok) {
+  uint32_t base = addr & ~(CACHE_LINE_SIZE - 1);
+  if (!cache_cacheable(base))
+    return NULL;
+
+  cache_line *line = cache_slot(base);
+  if (line->addr == base) {
+    cache_hits++;
+    return line;
+  }
+
+  cache_misses++;
+  line->addr = CACHE_INVALID;
+  if (!mem_get_block(base, line->data, CACHE_LINE_WORDS)) {
+    *ok = false;
+    return NULL;
+  }
+
+  line->addr = base;
+  return line;
+}
+
+//------------------------------------------------------------------------------
+// Copy a block out of the cache, only if every word of it is present.
+
+static bool cache_get_block(uint32_t addr, uint32_t *data, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    uint32_t a = addr + i * 4;
+    if (cache_slot(a)->addr != (a & ~(CACHE_LINE_SIZE - 1)))
+      return false;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    uint32_t a = addr + i * 4;
+    data[i] = cache_slot(a)->data[(a % CACHE_LINE_SIZE) / 4];
+  }
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Keep the lines a block read covered completely.
+
+static void cache_put_block(uint32_t addr, const uint32_t *data, size_t count) {
+  uint32_t end = addr + count * 4;
+  uint32_t base = (addr + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1);
+
+  for (; base + CACHE_LINE_SIZE <= end; base += CACHE_LINE_SIZE) {
+    if (!cache_cacheable(base))
+      continue;
+
+    cache_line *line = cache_slot(base);
+    memcpy(line->data, data + (base - addr) / 4, CACHE_LINE_SIZE);
+    line->addr = base;
+  }
+}
+
+//------------------------------------------------------------------------------
+// Write through: update the words of lines already present, or drop those lines
+// if the write failed and memory is in an unknown state.
+
+static void cache_write(uint32_t addr, const uint32_t *data, size_t count, bool ok) {
+  for (size_t i = 0; i < count; i++) {
+    uint32_t a = addr + i * 4;
+    cache_line *line = cache_slot(a);
+    if (line->addr != (a & ~(CACHE_LINE_SIZE - 1)))
+      continue;
+
+    if (ok)
+      line->data[(a % CACHE_LINE_SIZE) / 4] = data[i];
+    else
+      line->addr = CACHE_INVALID;
+  }
 }
 
+#endif  // MEM_CACHE
+
 //==============================================================================
-// Memory access - block
+// Flash mirror
+//
+// Code flash only changes when we program it, so pages read once are kept
+// across halt and resume. The flash writers update the mirror in place, erases
+// drop the pages, reset and "monitor flush" drop everything. Flash is visible
+// both at 0x00000000 (GDB's view) and at CH32_FLASH_ADDR.
+
+#if FLASH_MIRROR
+static uint32_t mirror[CH32_FLASH_SIZE / 4];
+static uint32_t mirror_valid[CH32_FLASH_PAGE_COUNT / 32];
+#endif
 
-bool ctx_get_block(uint32_t addr, uint32_t *data, size_t count) {
-#if PROG_DUMP
-  print_c("get blk: addr=%08X count=%d\n", addr, count);
+static uint32_t mirror_hits;
+static uint32_t mirror_misses;
+
+//------------------------------------------------------------------------------
+
+void ctx_mirror_flush(void) {
+#if FLASH_MIRROR
+  memset(mirror_valid, 0, sizeof(mirror_valid));
 #endif
+}
 
-  ctx_load_prog((uint32_t *)stub_get_block, sizeof(stub_get_block) / 4);
-  if (!gpr_cache_save(GPRB(S0) | GPRB(A0) | GPRB(A1))) return false;
+#if FLASH_MIRROR
 
-  // First kick
-  dm_set_data1(addr);
-  if (!ctx_exec_prog("getblk"))                        return false;
+//------------------------------------------------------------------------------
+// Returns the flash offset of [addr, addr + size) or -1 if it is not all flash.
 
-  // Read words using auto-execution
-  dm_set_abstractauto(DMAA_DATA0);
-  bool ret = false;
+static int mirror_offset(uint32_t addr, uint32_t size) {
+  if (addr >= CH32_FLASH_ADDR)
+    addr -= CH32_FLASH_ADDR;
+
+  if (addr >= CH32_FLASH_SIZE || size > CH32_FLASH_SIZE - addr)
+    return -1;
+  return addr;
+}
+
+//------------------------------------------------------------------------------
+
+static inline bool mirror_page_valid(uint32_t page) {
+  return mirror_valid[page / 32] & (1u << (page % 32));
+}
+
+//------------------------------------------------------------------------------
+
+static void mirror_page_set(uint32_t first, uint32_t count, bool valid) {
+  for (uint32_t page = first; page < first + count; page++) {
+    if (valid)
+      mirror_valid[page / 32] |= 1u << (page % 32);
+    else
+      mirror_valid[page / 32] &= ~(1u << (page % 32));
+  }
+}
+
+//------------------------------------------------------------------------------
+// Read from the mirror, runs of missing pages are filled with one block read.
+
+static bool mirror_get(uint32_t offset, uint32_t *data, size_t count) {
+  uint32_t first = offset / CH32_FLASH_PAGE_SIZE;
+  uint32_t last = (offset + count * 4 - 1) / CH32_FLASH_PAGE_SIZE;
+  bool hit = true;
+
+  for (uint32_t page = first; page <= last; page++) {
+    if (mirror_page_valid(page))
+      continue;
+
+    uint32_t n = 1;
+    while (page + n <= last && !mirror_page_valid(page + n))
+      n++;
+
+    uint32_t *dst = mirror + page * CH32_FLASH_PAGE_WORDS;
+    if (!mem_get_block(CH32_FLASH_ADDR + page * CH32_FLASH_PAGE_SIZE, dst,
+                       n * CH32_FLASH_PAGE_WORDS))
+      return false;
+
+    mirror_page_set(page, n, true);
+    page += n - 1;
+    hit = false;
+  }
+
+  if (hit)
+    mirror_hits++;
+  else
+    mirror_misses++;
+
+  memcpy(data, mirror + offset / 4, count * 4);
+  return true;
+}
+
+#endif  // FLASH_MIRROR
+
+//------------------------------------------------------------------------------
+
+void ctx_mirror_drop(uint32_t addr, uint32_t size) {
+#if FLASH_MIRROR
+  int offset = mirror_offset(addr, size);
+  if (offset < 0 || !size)
+    return;
+
+  uint32_t first = offset / CH32_FLASH_PAGE_SIZE;
+  uint32_t last = (offset + size - 1) / CH32_FLASH_PAGE_SIZE;
+  mirror_page_set(first, last - first + 1, false);
+#endif
+}
+
+//------------------------------------------------------------------------------
+// Called after whole pages were programmed successfully.
+
+void ctx_mirror_update(uint32_t addr, const uint32_t *data, size_t count) {
+#if FLASH_MIRROR
+  int offset = mirror_offset(addr, count * 4);
+  if (offset < 0 || (offset % CH32_FLASH_PAGE_SIZE) || (count % CH32_FLASH_PAGE_WORDS))
+    return;
 
-  while (count > 1) {
-    // Next kick
-    *data++ = dm_get_data0();
-    if (!dm_abstractcs_wait())                         goto cleanup;
-    count--;
+  memcpy(mirror + offset / 4, data, count * 4);
+  mirror_page_set(offset / CH32_FLASH_PAGE_SIZE, count / CH32_FLASH_PAGE_WORDS, true);
+#endif
+}
+
+//------------------------------------------------------------------------------
+
+void ctx_mirror_dump(void) {
+  print_b(2, "flash mirror");
+  printf(": hits %d  misses %d", mirror_hits, mirror_misses);
+
+#if FLASH_MIRROR
+  uint32_t pages = 0;
+  for (uint32_t page = 0; page < CH32_FLASH_PAGE_COUNT; page++) {
+    if (mirror_page_valid(page))
+      pages++;
   }
+  printf("  pages %d/%d", pages, CH32_FLASH_PAGE_COUNT);
+#endif
+  putchar('\n');
+}
+
+//==============================================================================
+// Memory access - streams
+//
+// Block transfers kick the stub (or abstract command) once and stream the rest
+// with autoexec. With CTX_OPTIMISTIC the words go back to back and ABSTRACTCS
+// is checked once per STREAM_CHUNK words instead of after every word read. A
+// failed chunk is run again from its first word with a check after every kick.
+//
+// kick() points the stub at addr and runs it once, consuming the first word
+// (or pair) of data for sets. Pairs stream DATA0/DATA1 with autoexec on DATA1.
+
+#define STREAM_CHUNK  32  // Words
+
+typedef bool (*stream_kick)(uint32_t addr, const uint32_t *data);
+
+//------------------------------------------------------------------------------
+
+static bool stream_get(uint32_t addr, uint32_t *data, size_t count, stream_kick kick, bool pairs) {
+  uint8_t step = pairs ? 2 : 1;
+  uint32_t autoexec = pairs ? DMAA_DATA1 : DMAA_DATA0;
 
-  // Success
-  ret = true;
+  // First kick
+  if (!kick(addr, NULL))
+    return false;
+
+  // Read words using auto-execution, each read kicks the next one
+  dm_set_abstractauto(autoexec);
+
+  bool ret = true;
+  size_t last = count - step;
+  for (size_t i = 0; ret && i < last; ) {
+    size_t n = last - i < STREAM_CHUNK ? last - i : STREAM_CHUNK;
+
+    if (CTX_OPTIMISTIC) {
+      ret = pairs ? dm_get_data01_burst(data + i, n / 2) : dm_get_data0_burst(data + i, n);
+      if (ret) {
+        i += n;
+        continue;
+      }
+
+      // Resync at the first word of the chunk
+      dm_set_abstractauto(0);
+      ret = kick(addr + i * 4, NULL);
+      dm_set_abstractauto(autoexec);
+      if (!ret)
+        break;
+    }
+
+    ret = pairs ? dm_get_data01_stream(data + i, n / 2) : dm_get_data0_stream(data + i, n);
+    i += n;
+  }
 
-cleanup:
   // Disable auto-execution before reading the last word
   dm_set_abstractauto(0);
   if (!ret)
     return false;
 
-  *data = dm_get_data0();
+  data[last] = dm_get_data0();
+  if (pairs)
+    data[last + 1] = dm_get_data1();
   return true;
 }
 
 //------------------------------------------------------------------------------
 
-bool ctx_set_block(uint32_t addr, uint32_t *data, size_t count) {
-#if PROG_DUMP
-  print_c("set blk: addr=%08X count=%d\n", addr, count);
-#endif
-
-  ctx_load_prog((uint32_t *)stub_set_block, sizeof(stub_set_block) / 4);
-  if (!gpr_cache_save(GPRB(S0) | GPRB(A0) | GPRB(A1))) return false;
+static bool stream_set(uint32_t addr, const uint32_t *data, size_t count, stream_kick kick, bool pairs) {
+  uint8_t step = pairs ? 2 : 1;
+  uint32_t autoexec = pairs ? DMAA_DATA1 : DMAA_DATA0;
 
   // First kick
-  dm_set_data0(data[0]);
-  dm_set_data1(addr);
-  if (!ctx_exec_prog("getblk"))                        return false;
+  if (!kick(addr, data))
+    return false;
 
   // Write words using auto-execution
-  dm_set_abstractauto(DMAA_DATA0);
-  bool ret = false;
+  dm_set_abstractauto(autoexec);
 
-  for (size_t i = 1; i < count; i++) {
-    // Next kick
-    dm_set_data0(data[i]);
-    if (!dm_abstractcs_wait())                         goto cleanup;
-  }
+  bool ret = true;
+  for (size_t i = step; ret && i < count; ) {
+    size_t n = count - i < STREAM_CHUNK ? count - i : STREAM_CHUNK;
+
+    if (!CTX_OPTIMISTIC) {
+      ret = pairs ? dm_put_data01_stream(data + i, n / 2) : dm_put_data0_stream(data + i, n);
+      i += n;
+      continue;
+    }
+
+    ret = pairs ? dm_put_data01_burst(data + i, n / 2) : dm_put_data0_burst(data + i, n);
+    if (ret) {
+      i += n;
+      continue;
+    }
+
+    // Resync at the first word of the chunk, then one kick at a time
+    dm_set_abstractauto(0);
+    ret = kick(addr + i * 4, data + i);
+    dm_set_abstractauto(autoexec);
 
-  // Success
-  ret = true;
+    for (size_t j = i + step; ret && j < i + n; j += step)
+      ret = pairs ? dm_put_data01_stream(data + j, 1) : dm_put_data0_stream(data + j, 1);
+    i += n;
+  }
 
-cleanup:
   // Disable auto-execution
   dm_set_abstractauto(0);
   return ret;
 }
 
+//==============================================================================
+// Memory access - abstract commands
+//
+// If the debug module executes access memory commands, memory is read and
+// written without a progbuf stub, so no GPR has to be saved and restored.
+// Support is probed on the first access after attach by comparing a flash word
+// against the stub path.
+
+static bool mem_get32(uint32_t addr, uint32_t *data);
+
+//------------------------------------------------------------------------------
+
+static bool aam_probe(void) {
+  uint32_t expected;
+  aam = 0;
+  if (!mem_get32(CH32_FLASH_ADDR, &expected)) {
+    aam = -1;  // Try again next time, the hart may be running
+    return false;
+  }
+
+  dm_abstractcs_clear_err();
+  dm_set_data0(~expected);
+  dm_set_data1(CH32_FLASH_ADDR);
+  dm_set_command(DMCM_ACCESS_MEM | DMCM_AAMSIZE(32) | DMCM_AAMPOSTINC);
+
+  // Poll quietly, an unsupported command is not an error here
+  dm_abstractcs abstractcs;
+  for (int i = 0; i < 16; i++) {
+    abstractcs = dm_get_abstractcs();
+    if (!(abstractcs.raw & DMA_BUSY))
+      break;
+  }
+
+  if ((abstractcs.raw & DMA_BUSY) || abstractcs.b.CMDER) {
+    dm_abstractcs_clear_err();
+    return false;
+  }
+
+  // Post-increment is needed for the block streams
+  aam = dm_get_data0() == expected && dm_get_data1() == CH32_FLASH_ADDR + 4;
+  return aam;
+}
+
+//------------------------------------------------------------------------------
+
+static inline bool aam_enabled(void) {
+#if CTX_ABSTRACT
+  if (aam < 0)
+    aam_probe();
+  return aam > 0;
+#else
+  return false;
+#endif
+}
+
+//------------------------------------------------------------------------------
+
+static bool aam_get32(uint32_t addr, uint32_t *data) {
+  dm_abstractcs_clear_err();
+  dm_set_data1(addr);
+  dm_set_command(DMCM_ACCESS_MEM | DMCM_AAMSIZE(32));
+  if (!dm_abstractcs_wait())
+    return false;
+
+  *data = dm_get_data0();
+  return true;
+}
+
+//------------------------------------------------------------------------------
+
+static bool aam_set32(uint32_t addr, uint32_t data) {
+  dm_abstractcs_clear_err();
+  dm_set_data0(data);
+  dm_set_data1(addr);
+  dm_set_command(DMCM_ACCESS_MEM | DMCM_AAMSIZE(32) | DMCM_WRITE);
+  return dm_abstractcs_wait();
+}
+
+//------------------------------------------------------------------------------
+// Autoexec on DATA0 repeats the command, DATA1 advances by itself.
+
+static bool aam_kick(uint32_t addr, const uint32_t *data) {
+  uint32_t command = DMCM_ACCESS_MEM | DMCM_AAMSIZE(32) | DMCM_AAMPOSTINC;
+
+  dm_abstractcs_clear_err();
+  if (data) {
+    dm_set_data0(data[0]);
+    command |= DMCM_WRITE;
+  }
+  dm_set_data1(addr);
+  dm_set_command(command);
+  return dm_abstractcs_wait();
+}
+
+//------------------------------------------------------------------------------
+
+static inline bool aam_get_block(uint32_t addr, uint32_t *data, size_t count) {
+  return stream_get(addr, data, count, aam_kick, false);
+}
+
+//------------------------------------------------------------------------------
+
+static inline bool aam_set_block(uint32_t addr, const uint32_t *data, size_t count) {
+  return stream_set(addr, data, count, aam_kick, false);
+}
+
+//==============================================================================
+// Memory access - GET
+
+bool ctx_get_mem32(uint32_t addr, uint32_t* data) {
+  uint32_t data_lo;
+  uint32_t addr_lo = addr & ~3;
+  if (!ctx_get_mem32_aligned(addr_lo, &data_lo))
+    return false;
+
+  uint8_t offset = addr & 3;
+  if (offset == 0) {
+    *data = data_lo;
+    return true;
+  }
+
+  uint32_t data_hi;
+  if (!ctx_get_mem32_aligned(addr_lo + 4, &data_hi))
+    return false;
+
+  offset *= 8;
+  data_lo >>= offset;
+  data_hi <<= 32 - offset;
+
+  *data = data_lo | data_hi;
+  return true;
+}
+
+//------------------------------------------------------------------------------
+
+bool ctx_get_mem16(uint32_t addr, uint16_t *data) {
+  uint32_t data_lo;
+  uint32_t addr_lo = addr & ~3;
+  if (!ctx_get_mem32_aligned(addr_lo, &data_lo))
+    return false;
+
+  uint8_t offset = addr & 3;
+  if (offset < 3) {
+    offset *= 8;
+    data_lo >>= offset;
+
+    *data = data_lo;
+    return true;
+  }
+
+  data_lo >>= 24;
+
+  uint32_t data_hi;
+  if (!ctx_get_mem32_aligned(addr_lo + 4, &data_hi))
+    return false;
+
+  data_hi <<= 8;
+
+  *data = data_lo | data_hi;
+  return true;
+}
+
+//------------------------------------------------------------------------------
+
+bool ctx_get_mem8(uint32_t addr, uint8_t *data) {
+  uint32_t data_lo;
+  if (!ctx_get_mem32_aligned(addr & ~3, &data_lo))
+    return false;
+
+  uint8_t offset = (addr & 3) * 8;
+  *data = data_lo >> offset;
+  return true;
+}
+
+//==============================================================================
+// Memory access - SET
+
+bool ctx_set_mem32(uint32_t addr, uint32_t data) {
+  uint8_t offset = addr & 3;
+  if (offset == 0)
+    return ctx_set_mem32_aligned(addr, data);
+
+  uint32_t data_lo;
+  uint32_t addr_lo = addr & ~3;
+  if (!ctx_get_mem32_aligned(addr_lo, &data_lo))
+    return false;
+
+  uint32_t data_hi;
+  uint32_t addr_hi = addr_lo + 4;
+  if (!ctx_get_mem32_aligned(addr_hi, &data_hi))
+    return false;
+
+  switch (offset) {
+    case 1:
+      data_lo &= 0x000000FF;
+      data_lo |= data << 8;
+      data_hi &= 0xFFFFFF00;
+      data_hi |= data >> 24;  // 8+24=32
+      break;
+    case 2:
+      data_lo &= 0x0000FFFF;
+      data_lo |= data << 16;
+      data_hi &= 0xFFFF0000;
+      data_hi |= data >> 16;  // 16+16=32
+      break;
+    default:
+      data_lo &= 0x00FFFFFF;
+      data_lo |= data << 24;
+      data_hi &= 0xFF000000;
+      data_hi |= data >> 8;   // 24+8=32
+  }
+
+  return ctx_set_mem32_aligned(addr_lo, data_lo) &&
+         ctx_set_mem32_aligned(addr_hi, data_hi);
+}
+
+//------------------------------------------------------------------------------
+
+bool ctx_set_mem16(uint32_t addr, uint16_t data) {
+  uint32_t data_lo;
+  uint32_t addr_lo = addr & ~3;
+  if (!ctx_get_mem32_aligned(addr_lo, &data_lo))
+    return false;
+
+  uint32_t offset = addr & 3;
+  switch (offset) {
+    case 0:
+      data_lo &= 0xFFFF0000;
+      data_lo |= data;
+      break;
+    case 1:
+      data_lo &= 0xFF0000FF;
+      data_lo |= (uint32_t)data << 8;
+      break;
+    case 2:
+      data_lo &= 0x0000FFFF;
+      data_lo |= (uint32_t)data << 16;
+      break;
+    default:
+      data_lo &= 0x00FFFFFF;
+      data_lo |= (uint32_t)data << 24;
+  }
+
+  if (!ctx_set_mem32_aligned(addr_lo, data_lo))
+    return false;
+
+  if (offset != 3)
+    return true;
+
+  uint32_t data_hi;
+  uint32_t addr_hi = addr_lo + 4;
+  if (!ctx_get_mem32_aligned(addr_hi, &data_hi))
+    return false;
+
+  data_hi &= 0xFFFFFF00;
+  data_hi |= HIBYTE(data);
+  return ctx_set_mem32_aligned(addr_hi, data_hi);
+}
+
+//------------------------------------------------------------------------------
+
+bool ctx_set_mem8(uint32_t addr, uint8_t data) {
+  uint32_t data_lo;
+  uint32_t addr_lo = addr & ~3;
+  if (!ctx_get_mem32_aligned(addr_lo, &data_lo))
+    return false;
+
+  switch (addr & 3) {
+    case 0:
+      data_lo &= 0xFFFFFF00;
+      data_lo |= data;
+      break;
+    case 1:
+      data_lo &= 0xFFFF00FF;
+      data_lo |= (uint32_t)data << 8;
+      break;
+    case 2:
+      data_lo &= 0xFF00FFFF;
+      data_lo |= (uint32_t)data << 16;
+      break;
+    default:
+      data_lo &= 0x00FFFFFF;
+      data_lo |= (uint32_t)data << 24;
+  }
+
+  return ctx_set_mem32_aligned(addr_lo, data_lo);
+}
+
+//------------------------------------------------------------------------------
+
+static bool mem_get32(uint32_t addr, uint32_t *data) {
+#if PROG_DUMP
+  print_c("get mem32: %08X\n", addr);
+#endif
+
+  if (aam_enabled())
+    return aam_get32(addr, data);
+
+  ctx_load_prog((uint32_t *)stub_mem, sizeof(stub_mem) / 4);
+  if (!gpr_cache_save(GPRB(S0) | GPRB(A0) | GPRB(A1)))
+    return false;
+
+  // Set LSB to 0 to indicate read operation
+  dm_set_data1(addr);
+  if (!ctx_exec_prog("get mem32"))
+    return false;
+
+  *data = dm_get_data0();
+  return swio_link_ok();
+}
+
+//------------------------------------------------------------------------------
+
+static bool mem_set32(uint32_t addr, uint32_t data) {
+#if PROG_DUMP
+  print_c("set mem32: addr=%08X\n", addr);
+#endif
+
+  if (aam_enabled())
+    return aam_set32(addr, data);
+
+  ctx_load_prog((uint32_t *)stub_mem, sizeof(stub_mem) / 4);
+  if (!gpr_cache_save(GPRB(S0) | GPRB(A0) | GPRB(A1)))
+    return false;
+
+  // Set LSB to 1 to indicate write operation
+  dm_set_data1(addr | 1);
+  dm_set_data0(data);
+
+  return ctx_exec_prog("set mem32");
+}
+
+//------------------------------------------------------------------------------
+
+bool ctx_get_mem32_aligned(uint32_t addr, uint32_t *data) {
+#if FLASH_MIRROR
+  int offset = mirror_offset(addr, 4);
+  if (offset >= 0)
+    return mirror_get(offset, data, 1);
+#endif
+
+#if MEM_CACHE
+  bool ok = true;
+  const cache_line *line = cache_get_line(addr, &ok);
+  if (line) {
+    *data = line->data[(addr % CACHE_LINE_SIZE) / 4];
+    return true;
+  }
+  if (!ok)
+    return false;
+#endif
+
+  return mem_get32(addr, data);
+}
+
+//------------------------------------------------------------------------------
+
+bool ctx_set_mem32_aligned(uint32_t addr, uint32_t data) {
+  bool ret = mem_set32(addr, data);
+  ctx_mirror_drop(addr, 4);
+
+#if MEM_CACHE
+  cache_write(addr, &data, 1, ret);
+#endif
+  return ret;
+}
+
+//==============================================================================
+// Memory access - block
+
+static bool block_pairs = CTX_BLOCK2;  // Use the two words per kick stubs
+
+// Shorter blocks stay on the resident stub, the pair stubs evict it
+#define BLOCK2_MIN_WORDS  16
+
+//------------------------------------------------------------------------------
+// Stream kicks, see "Memory access - streams". The stubs are loaded and s0 is
+// set up by the caller.
+
+static bool mem_kick(uint32_t addr, const uint32_t *data) {
+  // Set LSB to 1 to indicate write operation
+  if (data) {
+    dm_set_data0(data[0]);
+    addr |= 1;
+  }
+  dm_set_data1(addr);
+  return ctx_exec_prog("blk");
+}
+
+//------------------------------------------------------------------------------
+
+static bool a1_kick(uint32_t addr, const uint32_t *data) {
+  if (!gpr_set_a(1, addr))
+    return false;
+
+  if (data)
+    dm_set_data0(data[0]);
+  return ctx_exec_prog("blk a1");
+}
+
+//------------------------------------------------------------------------------
+
+static bool pair_kick(uint32_t addr, const uint32_t *data) {
+  if (!gpr_set_a(1, addr))
+    return false;
+
+  if (data) {
+    dm_set_data0(data[0]);
+    dm_set_data1(data[1]);
+  }
+  return ctx_exec_prog("blk2");
+}
+
+//------------------------------------------------------------------------------
+// An odd word count leaves the last word to the single word stub.
+
+static bool mem_get_block2(uint32_t addr, uint32_t *data, size_t count) {
+  size_t pairs = count / 2;
+
+  ctx_load_prog((uint32_t *)stub_get_block2, sizeof(stub_get_block2) / 4);
+  if (!gpr_cache_save(GPRB(S0) | GPRB(A0) | GPRB(A1)))     return false;
+  if (!gpr_set_s(0, DM_DATA_ADDR))                         return false;
+  if (!stream_get(addr, data, pairs * 2, pair_kick, true)) return false;
+
+  if (count & 1)
+    return mem_get32(addr + (count - 1) * 4, &data[count - 1]);
+  return true;
+}
+
+//------------------------------------------------------------------------------
+
+static bool mem_set_block2(uint32_t addr, uint32_t *data, size_t count) {
+  size_t pairs = count / 2;
+
+  ctx_load_prog((uint32_t *)stub_set_block2, sizeof(stub_set_block2) / 4);
+  if (!gpr_cache_save(GPRB(S0) | GPRB(A0) | GPRB(A1)))     return false;
+  if (!gpr_set_s(0, DM_DATA_ADDR))                         return false;
+  if (!stream_set(addr, data, pairs * 2, pair_kick, true)) return false;
+
+  if (count & 1)
+    return mem_set32(addr + (count - 1) * 4, data[count - 1]);
+  return true;
+}
+
+//------------------------------------------------------------------------------
+
+static bool mem_get_block(uint32_t addr, uint32_t *data, size_t count) {
+#if PROG_DUMP
+  print_c("get blk: addr=%08X count=%d\n", addr, count);
+#endif
+
+  if (!count)
+    return true;
+
+  if (aam_enabled())
+    return aam_get_block(addr, data, count);
+  if (block_pairs && count >= BLOCK2_MIN_WORDS)
+    return mem_get_block2(addr, data, count);
+
+  ctx_load_prog((uint32_t *)stub_mem, sizeof(stub_mem) / 4);
+  if (!gpr_cache_save(GPRB(S0) | GPRB(A0) | GPRB(A1)))
+    return false;
+
+  return stream_get(addr, data, count, mem_kick, false);
+}
+
+//------------------------------------------------------------------------------
+
+static bool mem_set_block(uint32_t addr, uint32_t *data, size_t count) {
+#if PROG_DUMP
+  print_c("set blk: addr=%08X count=%d\n", addr, count);
+#endif
+
+  if (!count)
+    return true;
+
+  if (aam_enabled())
+    return aam_set_block(addr, data, count);
+  if (block_pairs && count >= BLOCK2_MIN_WORDS)
+    return mem_set_block2(addr, data, count);
+
+  ctx_load_prog((uint32_t *)stub_mem, sizeof(stub_mem) / 4);
+  if (!gpr_cache_save(GPRB(S0) | GPRB(A0) | GPRB(A1)))
+    return false;
+
+  return stream_set(addr, data, count, mem_kick, false);
+}
+
+//------------------------------------------------------------------------------
+
+bool ctx_get_block(uint32_t addr, uint32_t *data, size_t count) {
+#if FLASH_MIRROR
+  int offset = mirror_offset(addr, count * 4);
+  if (offset >= 0 && count)
+    return mirror_get(offset, data, count);
+#endif
+
+#if MEM_CACHE
+  if (count && cache_get_block(addr, data, count)) {
+    cache_hits++;
+    return true;
+  }
+
+  if (!mem_get_block(addr, data, count))
+    return false;
+
+  if (count) {
+    cache_misses++;
+    cache_put_block(addr, data, count);
+  }
+  return true;
+#else
+  return mem_get_block(addr, data, count);
+#endif
+}
+
+//------------------------------------------------------------------------------
+
+bool ctx_set_block(uint32_t addr, uint32_t *data, size_t count) {
+  bool ret = mem_set_block(addr, data, count);
+  ctx_mirror_drop(addr, count * 4);
+
+#if MEM_CACHE
+  cache_write(addr, data, count, ret);
+#endif
+  return ret;
+}
+
+//------------------------------------------------------------------------------
+// Time 1 KB block transfers with the stubs and the abstract commands, bypassing
+// the caches. RAM is written back with the data just read from it.
+
+static const char *bench_modes[] = { "1 word", "2 words", "abstract" };
+
+static void bench_block(const char *name, uint32_t addr, uint32_t *buf, bool write, bool abstract) {
+  print_b(2, "%s", name);
+  putchar(':');
+
+  for (int mode = 0; mode < (abstract ? 3 : 2); mode++) {
+    aam = mode == 2;
+    block_pairs = mode == 1;
+
+    uint32_t start = time_us_32();
+    bool ok = write ? mem_set_block(addr, buf, 256) : mem_get_block(addr, buf, 256);
+    uint32_t us = time_us_32() - start;
+
+    if (!ok) {
+      print_r(2, "%s failed\n", bench_modes[mode]);
+      return;
+    }
+    printf("  %s %6d us", bench_modes[mode], us);
+  }
+  putchar('\n');
+}
+
+//------------------------------------------------------------------------------
+
+void ctx_bench(void) {
+  print_y(0, "debug:bench\n");
+
+  if (!ctx_halted("benchmark"))
+    return;
+
+  bool abstract = aam_enabled();
+  int8_t save_aam = aam;
+  bool save_pairs = block_pairs;
+  uint32_t buf[256];
+
+  bench_block("get flash", CH32_FLASH_ADDR, buf, false, abstract);
+  bench_block("get ram", 0x20000400, buf, false, abstract);
+  bench_block("set ram", 0x20000400, buf, true, abstract);
+
+  aam = save_aam;
+  block_pairs = save_pairs;
+}
+
+//==============================================================================
+// Memory access - gather/scatter
+//
+// Words at unrelated addresses, e.g. a watch window. The first access of a
+// chunk sets up the stub or the abstract command like a single one would, the
+// rest only stream addresses through DATA1 with autoexec, results come back
+// in DATA0. A chunk that fails is done again one access at a time.
+
+static bool gather_stream(const uint32_t *addrs, uint32_t *data, size_t count) {
+  if (!mem_get32(addrs[0], &data[0]))
+    return false;
+  if (count == 1)
+    return true;
+
+  dm_set_abstractauto(DMAA_DATA1);
+  bool ret = dm_gather_data0(addrs + 1, data + 1, count - 1);
+  dm_set_abstractauto(0);
+  if (ret)
+    return true;
+
+  for (size_t i = 1; i < count; i++) {
+    if (!mem_get32(addrs[i], &data[i]))
+      return false;
+  }
+  return true;
+}
+
+//------------------------------------------------------------------------------
+
+static bool scatter_stream(const uint32_t *addrs, const uint32_t *data, size_t count) {
+  if (!mem_set32(addrs[0], data[0]))
+    return false;
+  if (count == 1)
+    return true;
+
+  // Set LSB to 1 to indicate write operation to the stub
+  dm_set_abstractauto(DMAA_DATA1);
+  bool ret = dm_scatter_data0(addrs + 1, data + 1, count - 1, aam_enabled() ? 0 : 1);
+  dm_set_abstractauto(0);
+  if (ret)
+    return true;
+
+  for (size_t i = 1; i < count; i++) {
+    if (!mem_set32(addrs[i], data[i]))
+      return false;
+  }
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// The mirror and the cache serve what they can, unaligned words take the
+// ctx_get_mem32 path.
+
+bool ctx_gather(const uint32_t *addrs, uint32_t *data, size_t count) {
+  uint32_t miss_addrs[STREAM_CHUNK];
+  uint32_t miss_data[STREAM_CHUNK];
+  size_t miss_index[STREAM_CHUNK];
+
+  for (size_t i = 0; i < count; ) {
+    size_t misses = 0;
+
+    for (; i < count && misses < STREAM_CHUNK; i++) {
+      uint32_t addr = addrs[i];
+      if (addr & 3) {
+        if (!ctx_get_mem32(addr, &data[i]))
+          return false;
+        continue;
+      }
+
+#if FLASH_MIRROR
+      int offset = mirror_offset(addr, 4);
+      if (offset >= 0) {
+        if (!mirror_get(offset, &data[i], 1))
+          return false;
+        continue;
+      }
+#endif
+
+#if MEM_CACHE
+      if (cache_get_block(addr, &data[i], 1)) {
+        cache_hits++;
+        continue;
+      }
+      cache_misses++;
+#endif
+
+      miss_addrs[misses] = addr;
+      miss_index[misses++] = i;
+    }
+
+    if (misses && !gather_stream(miss_addrs, miss_data, misses))
+      return false;
+
+    for (size_t j = 0; j < misses; j++)
+      data[miss_index[j]] = miss_data[j];
+  }
+  return true;
+}
+
+//------------------------------------------------------------------------------
+
+bool ctx_scatter(const uint32_t *addrs, const uint32_t *data, size_t count) {
+  uint32_t chunk_addrs[STREAM_CHUNK];
+  uint32_t chunk_data[STREAM_CHUNK];
+
+  for (size_t i = 0; i < count; ) {
+    size_t n = 0;
+
+    for (; i < count && n < STREAM_CHUNK; i++) {
+      if (addrs[i] & 3) {
+        if (!ctx_set_mem32(addrs[i], data[i]))
+          return false;
+        continue;
+      }
+
+      chunk_addrs[n] = addrs[i];
+      chunk_data[n++] = data[i];
+    }
+
+    if (!n)
+      continue;
+
+    bool ret = scatter_stream(chunk_addrs, chunk_data, n);
+    for (size_t j = 0; j < n; j++) {
+      ctx_mirror_drop(chunk_addrs[j], 4);
+#if MEM_CACHE
+      cache_write(chunk_addrs[j], &chunk_data[j], 1, ret);
+#endif
+    }
+
+    if (!ret)
+      return false;
+  }
+  return true;
+}
+
+//==============================================================================
+// Memory access - CRC-32
+//
+// The target checksums the range itself and only the result crosses the link.
+// Runs are kept short enough (~250 target cycles per word) to stay well inside
+// the abstract command timeout, a0 carries the CRC from one run to the next.
+
+#define CRC32_CHUNK_WORDS  64
+
+bool ctx_crc32(uint32_t addr, size_t size, uint32_t *crc) {
+  CHECK(!(addr & 3) && !(size & 3));
+
+  ctx_load_prog((uint32_t *)stub_crc32, sizeof(stub_crc32) / 4);
+  if (!gpr_cache_save(GPRB(S0) | GPRB(A0) | GPRB(A1) | GPRB(A2) | GPRB(A3) |
+        GPRB(A4) | GPRB(A5)))              return false;
+
+  if (!gpr_set_s(0, DM_DATA_ADDR))         return false;
+  if (!gpr_set_a(0, ~0u))                  return false;
+  if (!gpr_set_a(1, addr))                 return false;
+  if (!gpr_set_a(3, CRC32_POLY))           return false;
+
+  uint32_t end = addr + size;
+  uint32_t value = ~0u;
+
+  while (addr < end) {
+    uint32_t chunk = end - addr < CRC32_CHUNK_WORDS * 4 ? end - addr : CRC32_CHUNK_WORDS * 4;
+    addr += chunk;
+
+    dm_set_data0(addr);
+    if (!ctx_exec_prog("crc32"))           return false;
+    value = dm_get_data0();
+  }
+
+  *crc = ~value;
+  return true;
+}
+
+//==============================================================================
+// Memory agent
+//
+// Fill, compare and search run on the target, only the results come back.
+// Every run covers at most AGENT_CHUNK bytes to stay inside the abstract
+// command timeout, the stub registers carry the state from one run to the
+// next.
+
+#define AGENT_CHUNK  1024  // Bytes
+
+static inline uint32_t agent_chunk_end(uint32_t pos, uint32_t end) {
+  return end - pos < AGENT_CHUNK ? end : pos + AGENT_CHUNK;
+}
+
+//------------------------------------------------------------------------------
+// The unaligned head and tail go through ctx_write.
+
+bool ctx_fill(uint32_t addr, size_t size, uint8_t value) {
+  uint8_t bytes[4];
+  memset(bytes, value, sizeof(bytes));
+
+  size_t head = -addr & 3;
+  if (head > size)
+    head = size;
+  if (head && !ctx_write(addr, bytes, head))
+    return false;
+
+  addr += head;
+  size -= head;
+
+  size_t tail = size & 3;
+  uint32_t end = addr + size - tail;
+
+  if (addr < end) {
+    ctx_mirror_drop(addr, end - addr);
+    ctx_cache_flush();
+
+    ctx_load_prog((uint32_t *)stub_fill, sizeof(stub_fill) / 4);
+    if (!gpr_cache_save(GPRB(S0) | GPRB(A1) | GPRB(A2) | GPRB(A5))) return false;
+    if (!gpr_set_s(0, DM_DATA_ADDR))                              return false;
+    if (!gpr_set_a(1, addr))                                      return false;
+    if (!gpr_set_a(5, value * 0x01010101u))                       return false;
+
+    for (uint32_t pos = addr; pos < end; ) {
+      pos = agent_chunk_end(pos, end);
+      dm_set_data0(pos);
+      if (!ctx_exec_prog("fill"))                                 return false;
+    }
+  }
+
+  return !tail || ctx_write(end, bytes, tail);
+}
+
+//------------------------------------------------------------------------------
+// offset = first differing word of the aligned ranges, size if they match.
+
+bool ctx_compare(uint32_t addr1, uint32_t addr2, size_t size, uint32_t *offset) {
+  if ((addr1 | addr2 | size) & 3)
+    return false;
+
+  *offset = size;
+  if (!size)
+    return true;
+
+  ctx_load_prog((uint32_t *)stub_compare, sizeof(stub_compare) / 4);
+  if (!gpr_cache_save(GPRB(S0) | GPRB(A0) | GPRB(A1) | GPRB(A2) | GPRB(A3) |
+        GPRB(A4)))                         return false;
+  if (!gpr_set_s(0, DM_DATA_ADDR))         return false;
+  if (!gpr_set_a(1, addr1))                return false;
+  if (!gpr_set_a(3, addr2))                return false;
+
+  uint32_t end = addr1 + size;
+  for (uint32_t pos = addr1; pos < end; ) {
+    uint32_t chunk_end = agent_chunk_end(pos, end);
+    dm_set_data0(chunk_end);
+    if (!ctx_exec_prog("compare"))         return false;
+
+    pos = dm_get_data0();
+    if (pos != chunk_end) {
+      *offset = pos - addr1;
+      break;
+    }
+  }
+  return true;
+}
+
+//------------------------------------------------------------------------------
+
+static bool find_setup(uint32_t pos, uint32_t mask, uint32_t value) {
+  ctx_load_prog((uint32_t *)stub_find, sizeof(stub_find) / 4);
+  if (!gpr_cache_save(GPRB(S0) | GPRB(A0) | GPRB(A1) | GPRB(A2) | GPRB(A3) |
+        GPRB(A4) | GPRB(A5)))              return false;
+  if (!gpr_set_s(0, DM_DATA_ADDR))         return false;
+  if (!gpr_set_a(0, 0))                    return false;
+  if (!gpr_set_a(1, pos))                  return false;
+  if (!gpr_set_a(3, mask))                 return false;
+  return gpr_set_a(5, value);
+}
+
+//------------------------------------------------------------------------------
+// 1 = the rest of the pattern matches too, 0 = it doesn't, -1 = error.
+
+static int find_verify(uint32_t addr, const uint8_t *pattern, size_t len) {
+  uint8_t buf[64];
+
+  for (size_t i = 0; i < len; ) {
+    size_t n = len - i < sizeof(buf) ? len - i : sizeof(buf);
+    if (!ctx_read(addr + i, buf, n))
+      return -1;
+    if (memcmp(buf, pattern + i, n))
+      return 0;
+    i += n;
+  }
+  return 1;
+}
+
+//------------------------------------------------------------------------------
+// The target matches the first 4 bytes of the pattern, we check the rest of
+// each candidate. 1 = found at *found, 0 = not found, -1 = error.
+
+int ctx_find(uint32_t addr, size_t size, const uint8_t *pattern, size_t len, uint32_t *found) {
+  if (!len || len > size)
+    return 0;
+
+  uint8_t k = len < 4 ? len : 4;
+  uint8_t shift = 32 - 8 * k;
+  uint32_t mask = ~0u << shift;
+  uint32_t value = 0;
+  for (uint8_t i = 0; i < k; i++)
+    value |= (uint32_t)pattern[i] << (shift + 8 * i);
+
+  // Windows past end leave no room for the rest of the pattern
+  uint32_t end = addr + size - (len - k);
+  uint32_t pos = addr;    // Next byte to scan
+  uint32_t first = addr;  // Earliest start, the window isn't full before
+  bool setup = true;
+
+  while (pos < end) {
+    if (setup && !find_setup(pos, mask, value))
+      return -1;
+    setup = false;
+
+    dm_set_data0(agent_chunk_end(pos, end));
+    if (!ctx_exec_prog("find"))
+      return -1;
+
+    pos = dm_get_data0();
+    if (dm_get_data1() != value || pos < first + k)
+      continue;
+
+    uint32_t start = pos - k;
+    if (len > k) {
+      // ctx_read clobbers the stub registers
+      int ret = find_verify(start + k, pattern + k, len - k);
+      if (ret < 0)
+        return -1;
+      if (!ret) {
+        pos = first = start + 1;
+        setup = true;
+        continue;
+      }
+    }
+
+    *found = start;
+    return 1;
+  }
+  return 0;
+}
+
+//==============================================================================
+// Memory access - bytes
+//
+// Any address and length: the unaligned head and tail cost one word access
+// each (read-modify-write for ctx_write), the aligned middle is streamed.
+
+#define BYTES_CHUNK_WORDS  64
+
+bool ctx_read(uint32_t addr, uint8_t *data, size_t size) {
+  // Head
+  uint32_t offset = addr & 3;
+  if (offset && size) {
+    uint32_t word;
+    if (!ctx_get_mem32_aligned(addr - offset, &word))
+      return false;
+
+    size_t n = size < 4 - offset ? size : 4 - offset;
+    memcpy(data, (uint8_t *)&word + offset, n);
+    addr += n;
+    data += n;
+    size -= n;
+  }
+
+  // Middle, bounced through a word buffer if data is unaligned
+  size_t words = size / 4;
+  if (!((uintptr_t)data & 3)) {
+    if (!ctx_get_block(addr, (uint32_t *)data, words))
+      return false;
+  } else {
+    uint32_t buf[BYTES_CHUNK_WORDS];
+    for (size_t i = 0; i < words; ) {
+      size_t n = words - i < BYTES_CHUNK_WORDS ? words - i : BYTES_CHUNK_WORDS;
+      if (!ctx_get_block(addr + i * 4, buf, n))
+        return false;
+      memcpy(data + i * 4, buf, n * 4);
+      i += n;
+    }
+  }
+
+  addr += words * 4;
+  data += words * 4;
+  size -= words * 4;
+
+  // Tail
+  if (size) {
+    uint32_t word;
+    if (!ctx_get_mem32_aligned(addr, &word))
+      return false;
+    memcpy(data, &word, size);
+  }
+  return true;
+}
+
+//------------------------------------------------------------------------------
+
+bool ctx_write(uint32_t addr, const uint8_t *data, size_t size) {
+  // Head
+  uint32_t offset = addr & 3;
+  if (offset && size) {
+    uint32_t word;
+    if (!ctx_get_mem32_aligned(addr - offset, &word))
+      return false;
+
+    size_t n = size < 4 - offset ? size : 4 - offset;
+    memcpy((uint8_t *)&word + offset, data, n);
+    if (!ctx_set_mem32_aligned(addr - offset, word))
+      return false;
+
+    addr += n;
+    data += n;
+    size -= n;
+  }
+
+  // Middle, bounced through a word buffer if data is unaligned
+  size_t words = size / 4;
+  if (!((uintptr_t)data & 3)) {
+    if (!ctx_set_block(addr, (uint32_t *)data, words))
+      return false;
+  } else {
+    uint32_t buf[BYTES_CHUNK_WORDS];
+    for (size_t i = 0; i < words; ) {
+      size_t n = words - i < BYTES_CHUNK_WORDS ? words - i : BYTES_CHUNK_WORDS;
+      memcpy(buf, data + i * 4, n * 4);
+      if (!ctx_set_block(addr + i * 4, buf, n))
+        return false;
+      i += n;
+    }
+  }
+
+  addr += words * 4;
+  data += words * 4;
+  size -= words * 4;
+
+  // Tail
+  if (size) {
+    uint32_t word;
+    if (!ctx_get_mem32_aligned(addr, &word))
+      return false;
+
+    memcpy(&word, data, size);
+    return ctx_set_mem32_aligned(addr, word);
+  }
+  return true;
+}
+
+//==============================================================================
+// Memory access - 8/16-bit blocks
+//
+// Peripheral registers that only decode byte or halfword accesses. Full words
+// are packed, the remaining items go one per execution.
+
+#define narrow_load(stub)  ctx_load_prog((uint32_t *)stub, sizeof(stub) / 4)
+
+static bool narrow_setup(void) {
+  if (!gpr_cache_save(GPRB(S0) | GPRB(A0) | GPRB(A1) | GPRB(A2)))
+    return false;
+  return gpr_set_s(0, DM_DATA_ADDR);
+}
+
+//------------------------------------------------------------------------------
+
+static bool narrow_get(uint32_t addr, uint8_t *data, size_t size, uint8_t width) {
+  if (!size)
+    return true;
+  if (!narrow_setup())
+    return false;
+
+  size_t words = size / 4;
+  if (words) {
+    if (width == 1)
+      narrow_load(stub_get_block8);
+    else
+      narrow_load(stub_get_block16);
+
+    uint32_t buf[BYTES_CHUNK_WORDS];
+    for (size_t i = 0; i < words; ) {
+      size_t n = words - i < BYTES_CHUNK_WORDS ? words - i : BYTES_CHUNK_WORDS;
+      if (!stream_get(addr + i * 4, buf, n, a1_kick, false))
+        return false;
+
+      memcpy(data + i * 4, buf, n * 4);
+      i += n;
+    }
+  }
+
+  // Tail, a1 is right past the packed words
+  if (size == words * 4)
+    return true;
+  if (!words && !gpr_set_a(1, addr))
+    return false;
+
+  if (width == 1)
+    narrow_load(stub_get8);
+  else
+    narrow_load(stub_get16);
+
+  for (size_t i = words * 4; i < size; i += width) {
+    if (!ctx_exec_prog("get narrow"))
+      return false;
+
+    uint32_t item = dm_get_data0();
+    memcpy(data + i, &item, width);
+  }
+  return true;
+}
+
+//------------------------------------------------------------------------------
+
+static bool narrow_set(uint32_t addr, const uint8_t *data, size_t size, uint8_t width) {
+  if (!size)
+    return true;
+
+  // Cheaper than tracking which lines the items hit
+  ctx_mirror_drop(addr, size);
+  ctx_cache_flush();
+
+  if (!narrow_setup())
+    return false;
+
+  size_t words = size / 4;
+  if (words) {
+    if (width == 1)
+      narrow_load(stub_set_block8);
+    else
+      narrow_load(stub_set_block16);
+
+    uint32_t buf[BYTES_CHUNK_WORDS];
+    for (size_t i = 0; i < words; ) {
+      size_t n = words - i < BYTES_CHUNK_WORDS ? words - i : BYTES_CHUNK_WORDS;
+      memcpy(buf, data + i * 4, n * 4);
+      if (!stream_set(addr + i * 4, buf, n, a1_kick, false))
+        return false;
+      i += n;
+    }
+  }
+
+  // Tail, a1 is right past the packed words
+  if (size == words * 4)
+    return true;
+  if (!words && !gpr_set_a(1, addr))
+    return false;
+
+  if (width == 1)
+    narrow_load(stub_set8);
+  else
+    narrow_load(stub_set16);
+
+  for (size_t i = words * 4; i < size; i += width) {
+    uint32_t item = 0;
+    memcpy(&item, data + i, width);
+    dm_set_data0(item);
+    if (!ctx_exec_prog("set narrow"))
+      return false;
+  }
+  return true;
+}
+
+//------------------------------------------------------------------------------
+
+bool ctx_get_block8(uint32_t addr, uint8_t *data, size_t count) {
+  return narrow_get(addr, data, count, 1);
+}
+
+//------------------------------------------------------------------------------
+
+bool ctx_set_block8(uint32_t addr, const uint8_t *data, size_t count) {
+  return narrow_set(addr, data, count, 1);
+}
+
+//------------------------------------------------------------------------------
+
+bool ctx_get_block16(uint32_t addr, uint16_t *data, size_t count) {
+  if (addr & 1) {
+    print_r(2, "mem16: unaligned address %08X\n", addr);
+    return false;
+  }
+  return narrow_get(addr, (uint8_t *)data, count * 2, 2);
+}
+
+//------------------------------------------------------------------------------
+
+bool ctx_set_block16(uint32_t addr, const uint16_t *data, size_t count) {
+  if (addr & 1) {
+    print_r(2, "mem16: unaligned address %08X\n", addr);
+    return false;
+  }
+  return narrow_set(addr, (const uint8_t *)data, count * 2, 2);
+}
+
 //==============================================================================
 // RISC-V-specific CSRs
 
@@ -1,6 +1,6 @@
 // API wrapper around the Risc-V Debug Module. Adds convenient register access,
 // (mis)aligned memory read/write, bulk read/write, and caching of GPRs/PROG{N}
-// registers to reduce traffic on the DMI bus.
+// registers and memory reads to reduce traffic on the DMI bus.
 
 #pragma once
 
@@ -25,14 +25,34 @@ bool ctx_reset(void);
 
 //----------
 // Run small (32 byte on CH32V003) programs from the debug program buffer
+// Stubs have to fit the 8 PROGBUF words of the CH32V003
+#define CTX_PROG_BYTES  32
+
 void ctx_load_prog(const uint32_t *prog, uint8_t size);
 bool ctx_exec_prog(const char *name);
 
 bool ctx_read_reg(uint16_t regno, uint32_t* value);
 bool ctx_write_reg(uint16_t regno, uint32_t value);
 
+//----------
+// Register snapshot, taken on the first access after a halt. Writes are kept
+// and reach the hart in ctx_resume.
+#define CTX_REG_PC       32  // GPRs are 0..31, as in GDB
+#define CTX_REG_DCSR     33
+#define CTX_REG_MSTATUS  34
+#define CTX_REG_MAX      35
+
+bool ctx_get_reg(uint8_t regno, uint32_t *value);
+bool ctx_set_reg(uint8_t regno, uint32_t value);
+
+// All gpr_max GPRs at once, as the debugged program sees them
+bool ctx_get_gprs(uint32_t *regs);
+bool ctx_set_gprs(const uint32_t *regs);
+
 //----------
 // Memory access
+#define CTX_PERIPH_ADDR  0x40000000  // Peripherals, core and debug registers
+
 bool ctx_get_mem32_aligned(uint32_t addr, uint32_t *data);
 bool ctx_set_mem32_aligned(uint32_t addr, uint32_t data);
 
@@ -50,7 +70,50 @@ bool ctx_set_mem8(uint32_t addr, uint8_t data);
 bool ctx_get_block(uint32_t addr, uint32_t *data, size_t count);
 bool ctx_set_block(uint32_t addr, uint32_t *data, size_t count);
 
+//----------
+// Words at unrelated addresses, streamed with one stub setup per call
+bool ctx_gather(const uint32_t *addrs, uint32_t *data, size_t count);
+bool ctx_scatter(const uint32_t *addrs, const uint32_t *data, size_t count);
+
+//----------
+// CRC-32 computed on the target (aligned), see crc32_calc()
+bool ctx_crc32(uint32_t addr, size_t size, uint32_t *crc);
+
+//----------
+// Memory agent running on the target: memset, memcmp (aligned) and search.
+// ctx_find returns 1 = found, 0 = not found, -1 = error.
+bool ctx_fill(uint32_t addr, size_t size, uint8_t value);
+bool ctx_compare(uint32_t addr1, uint32_t addr2, size_t size, uint32_t *offset);
+int ctx_find(uint32_t addr, size_t size, const uint8_t *pattern, size_t len, uint32_t *found);
+
+//----------
+// 8/16-bit bulk access, one lbu/lhu/sb/sh per item (peripheral registers)
+bool ctx_get_block8(uint32_t addr, uint8_t *data, size_t count);
+bool ctx_set_block8(uint32_t addr, const uint8_t *data, size_t count);
+
+bool ctx_get_block16(uint32_t addr, uint16_t *data, size_t count);
+bool ctx_set_block16(uint32_t addr, const uint16_t *data, size_t count);
+
+//----------
+// Byte-granular memory access (any address and size)
+bool ctx_read(uint32_t addr, uint8_t *data, size_t size);
+bool ctx_write(uint32_t addr, const uint8_t *data, size_t size);
+
+//----------
+// Memory read cache, valid while the hart stays halted
+void ctx_cache_flush(void);
+bool ctx_cache_uncached(uint32_t start, uint32_t end);
+void ctx_cache_dump(void);
+
+//----------
+// Code flash mirror, valid until reset or until we program flash
+void ctx_mirror_flush(void);
+void ctx_mirror_drop(uint32_t addr, uint32_t size);
+void ctx_mirror_update(uint32_t addr, const uint32_t *data, size_t count);
+void ctx_mirror_dump(void);
+
 void ctx_test(void);
+void ctx_bench(void);
 
 //==============================================================================
 // RISC-V-specific CSRs
@@ -20,6 +20,17 @@
 
 #define LOGS  0
 
+#define CTX_ABSTRACT    1
+#define CTX_BLOCK2      1
+#define CTX_GPR_STREAM  1
+#define CTX_OPTIMISTIC  1
+#define FLASH_MIRROR    1
+#define MEM_CACHE       1
+
+#define SWIO_CALIBRATE  1
+#define SWIO_CHECKED    0
+#define SWIO_TRACE      1
+
 #define BREAK_DUMP   1
 #define GPR_DUMP     0
 #define PROG_DUMP    0
@@ -29,3 +40,7 @@
 #define DUMP_WORDS  (8*24)
 
 //------------------------------------------------------------------------------
+
+#define PICO_KEY_PIN  24
+
+//------------------------------------------------------------------------------
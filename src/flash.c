@@ -1,5 +1,4 @@
 #include <stdio.h>
-#include <stdlib.h>
 #include <pico/time.h>
 
 #include "flash.h"
@@ -86,21 +85,24 @@ bool flash_enabled(const char *halted_err, uint32_t mask) {
 
 //------------------------------------------------------------------------------
 
-bool flash_status_wait(void) {
-  for (int i = 0; i < 150; i++) {  // Timeout 60 ms
+bool flash_status_wait(wait_class cls) {
+  waiter w;
+  wait_begin(&w, cls);
+
+  do {
     flash_statr statr;
     if (!flash_get_statr(&statr))
       return false;
 
-    if (statr.raw & STATR_BUSY) {
-      sleep_us(400);
+    if (statr.raw & STATR_BUSY)
       continue;
-    }
+
+    wait_end(&w);
 
     // EOP and WRPRTERR are W1C; writing the current status value clears them.
     (void)flash_set_statr(statr.raw);
     return !(statr.raw & STATR_WRPRTERR);
-  }
+  } while (wait_next(&w, 60000));  // Timeout 60 ms
 
   print_r(2, "flash: status timeout\n");
   return false;  // Timeout
@@ -114,10 +116,15 @@ bool flash_start(uint32_t ctlr) {
   if (!flash_set_ctlr(ctlr))             return false;
 
   bool ret = false;
+  ctx_cache_flush();
+
+  // Option bytes go with the page erase, they are smaller than a page
+  wait_class cls = ctlr & CTLR_MER ? WAIT_FLASH_MER :
+                   ctlr & CTLR_PER ? WAIT_FLASH_PER : WAIT_FLASH_FTER;
 
   // Start the operation and wait for erase to complete
   if (!flash_set_ctlr(ctlr | CTLR_STRT)) goto cleanup;
-  if (!flash_status_wait())              goto cleanup;
+  if (!flash_status_wait(cls))           goto cleanup;
 
   ret = true;
 
@@ -135,6 +142,11 @@ cleanup:
 // Erase time dominated by flash HW, not debug overhead
 
 inline bool flash_erase(uint32_t addr, uint32_t ctlr) {
+  if (ctlr & CTLR_MER)
+    ctx_mirror_flush();
+  else
+    ctx_mirror_drop(addr, ctlr & CTLR_PER ? CH32_FLASH_SECTOR_SIZE : CH32_FLASH_PAGE_SIZE);
+
   if (!flash_set_addr(addr))
     return false;
   return flash_start(ctlr);
@@ -170,7 +182,7 @@ const uint16_t stub_write[] = {
   0xC8C0           // c.sw   s0, 20(s1)           ; *FLASH_ADDR = addr
 };
 
-_Static_assert(!(sizeof(stub_write) & 3), "stub_write");
+_Static_assert(!(sizeof(stub_write) & 3) && sizeof(stub_write) <= CTX_PROG_BYTES, "stub_write");
 
 //------------------------------------------------------------------------------
 // NOTE: Flash write must be page-aligned!
@@ -187,9 +199,11 @@ bool flash_write_pages(uint32_t addr, const uint32_t *data, size_t count) {
   if (!flash_set_ctlr(CTLR_OBWRE | CTLR_FTPG))               return false;
 
   bool ret = false;
+  ctx_cache_flush();
+
   if (!flash_set_ctlr(CTLR_OBWRE | CTLR_FTPG | CTLR_BUFRST)) goto cleanup;
   if (!flash_set_addr(addr))                                 goto cleanup;
-  if (!flash_status_wait())                                  goto cleanup;
+  if (!flash_status_wait(WAIT_FLASH_BUF))                    goto cleanup;
 
   ctx_load_prog((uint32_t *)stub_write, sizeof(stub_write) / 4);
   if (!gpr_cache_save(GPRB(S0) | GPRB(S1) | GPRB(A0) | GPRB(A1) | GPRB(A2) |
@@ -207,13 +221,17 @@ bool flash_write_pages(uint32_t addr, const uint32_t *data, size_t count) {
   dm_set_data0(data[0]);
   if (!ctx_exec_prog("flash write"))                         goto cleanup;
 
-  // Flash words using auto-execution
+  // Flash words using auto-execution. The last word of a page starts the
+  // page write, so every stream ends on a page boundary.
   dm_set_abstractauto(DMAA_DATA0);
 
-  for (size_t i = 1; i < count; i++) {
-    // Next kick
-    dm_set_data0(data[i]);
-    if (!dm_abstractcs_wait())                               goto cleanup;
+  // Each stream waits for the page write its last word starts
+  swio_set_command_class(WAIT_FLASH_PAGE);
+
+  for (size_t i = 1; i < count; ) {
+    size_t n = CH32_FLASH_PAGE_WORDS - (i % CH32_FLASH_PAGE_WORDS);
+    if (!dm_put_data0_stream(data + i, n))                   goto cleanup;
+    i += n;
   }
 
   // Success
@@ -229,13 +247,22 @@ cleanup:
   // Check write protection error
   flash_statr statr;
   if (!flash_get_statr(&statr))
-    return false;
+    ret = false;
+  else {
+    // EOP and WRPRTERR are W1C; writing the current status value clears them.
+    if (statr.raw & (STATR_EOP | STATR_WRPRTERR))
+      (void)flash_set_statr(statr.raw);
 
-  // EOP and WRPRTERR are W1C; writing the current status value clears them.
-  if (statr.raw & (STATR_EOP | STATR_WRPRTERR))
-    (void)flash_set_statr(statr.raw);
+    if (statr.raw & STATR_WRPRTERR)
+      ret = false;
+  }
 
-  return ret && !(statr.raw & STATR_WRPRTERR);
+  // Keep the mirror in sync with what we just programmed
+  if (ret)
+    ctx_mirror_update(addr, data, count);
+  else
+    ctx_mirror_drop(addr, count * 4);
+  return ret;
 }
 
 //------------------------------------------------------------------------------
@@ -243,20 +270,15 @@ cleanup:
 bool flash_verify_pages(uint32_t addr, const uint32_t *data, size_t count) {
   CHECK(!(addr & 3));
 
+  // The target checksums its flash, only the CRC crosses the link
   uint32_t bytes = count * 4;
-  uint32_t *readback = malloc(bytes);
-  bool ret = false;
-
-  if (!ctx_get_block(addr, readback, bytes)) goto cleanup;
-  for (size_t i = 0; i < count; i++)
-    if (data[i] != readback[i])              goto cleanup;
+  uint32_t crc;
+  if (ctx_crc32(addr, bytes, &crc) && crc == crc32_calc((const uint8_t *)data, bytes))
+    return true;
 
-  // Success
-  ret = true;
-
-cleanup:
-  free(readback);
-  return ret;
+  // The mirror no longer matches the target
+  ctx_mirror_drop(addr, bytes);
+  return false;
 }
 
 //------------------------------------------------------------------------------
@@ -264,25 +286,17 @@ cleanup:
 void flash_dump(uint32_t addr) {
   ctx_dump_block(addr, CH32_FLASH_ADDR, CH32_FLASH_SIZE);
 
-  flash_actlr actlr;
-  if (flash_get_actlr(&actlr))
-    flash_actlr_dump(actlr);
-
-  flash_ctlr ctlr;
-  if (flash_get_ctlr(&ctlr))
-    flash_ctlr_dump(ctlr);
-
-  flash_obr obr;
-  if (flash_get_obr(&obr))
-    flash_obr_dump(obr);
-
-  flash_statr statr;
-  if (flash_get_statr(&statr))
-    flash_statr_dump(statr);
-
-  uint32_t wpr;
-  if (flash_get_wpr(&wpr))
-    print_hex(0, "FLASH_WPR", wpr);
+  // All registers in one go
+  static const uint32_t regs[] = { FLASH_ACTLR, FLASH_CTLR, FLASH_OBR, FLASH_STATR, FLASH_WPR };
+  uint32_t values[count_of(regs)];
+  if (!ctx_gather(regs, values, count_of(regs)))
+    return;
+
+  flash_actlr_dump((flash_actlr) { .raw = values[0] });
+  flash_ctlr_dump((flash_ctlr) { .raw = values[1] });
+  flash_obr_dump((flash_obr) { .raw = values[2] });
+  flash_statr_dump((flash_statr) { .raw = values[3] });
+  print_hex(0, "FLASH_WPR", values[4]);
 }
 
 //==============================================================================
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "context.h"
+#include "utils.h"
 
 //==============================================================================
 // Flash registers (memory-mapped I/O)
@@ -207,7 +208,7 @@ int flash_fastprog_locked(void);
 int flash_fastprog_lock(void);
 int flash_fastprog_unlock(void);
 
-bool flash_status_wait(void);
+bool flash_status_wait(wait_class cls);
 bool flash_start(uint32_t ctlr);
 
 // Flash erase, addresses must be aligned
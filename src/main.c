@@ -41,8 +41,6 @@ static inline void reset(void) {
 
 //------------------------------------------------------------------------------
 
-#define PICO_KEY_PIN  24
-
 static inline void handle_key(void) {
   if (gpio_get(PICO_KEY_PIN))
     return;
@@ -21,7 +21,7 @@ static uint16_t stub_write[] = {
   0x9002           // c.ebreak
 };
 
-_Static_assert(!(sizeof(stub_write) & 3), "stub_write");
+_Static_assert(!(sizeof(stub_write) & 3) && sizeof(stub_write) <= CTX_PROG_BYTES, "stub_write");
 
 //------------------------------------------------------------------------------
 
@@ -84,6 +84,7 @@ bool optb_write(uint8_t offset, uint8_t *data, uint8_t count) {
   if (!flash_set_ctlr(CTLR_OBWRE | CTLR_OBPG))         return false;
 
   bool ret = false;
+  ctx_cache_flush();
 
   ctx_load_prog((uint32_t *)stub_write, sizeof(stub_write) / 4);
   if (!gpr_cache_save(GPRB(S0) | GPRB(A0) | GPRB(A1))) goto cleanup;
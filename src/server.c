@@ -174,7 +174,7 @@ void server_handle_c(void) {
   // Set PC if requested
   addr = packet_take_hex(&recv);
   if (!recv.error)
-    csr_set_dpc(addr);
+    ctx_set_reg(CTX_REG_PC, addr);
 
   // If we did not actually resume because we immediately hit a breakpoint,
   // respond with a "hit breakpoint" message. Otherwise we do not reply until
@@ -214,15 +214,15 @@ void server_handle_g(void) {
   else {
     packet_clear(&send);
 
-    for (size_t i = 0; i < gpr_max; i++) {
-      uint32_t gpr;
-      if (!gpr_get(i, &gpr))
-        return;
-      packet_put_hex_u32(&send, gpr);
-    }
+    uint32_t regs[32];
+    if (!ctx_get_gprs(regs))
+      return;
+
+    for (size_t i = 0; i < gpr_max; i++)
+      packet_put_hex_u32(&send, regs[i]);
 
     uint32_t dpc;
-    if (!csr_get_dpc(&dpc))
+    if (!ctx_get_reg(CTX_REG_PC, &dpc))
       return;
     packet_put_hex_u32(&send, dpc);
     send_valid = true;
@@ -237,13 +237,15 @@ void server_handle_g(void) {
 void server_handle_G(void) {
   packet_expect(&recv, 'G');
 
-  for (size_t i = 0; i < gpr_max; i++) {
-    uint32_t gpr = packet_take_hex_digits(&recv, 8);
-    gpr_set(i, gpr);
-  }
+  uint32_t regs[32];
+  for (size_t i = 0; i < gpr_max; i++)
+    regs[i] = packet_take_hex_digits(&recv, 8);
 
   uint32_t dpc = packet_take_hex_digits(&recv, 8);
-  csr_set_dpc(dpc);
+  if (!recv.error) {
+    ctx_set_gprs(regs);
+    ctx_set_reg(CTX_REG_PC, dpc);
+  }
 
   if (recv.error)
     server_set_resp("E01", 3);
@@ -284,11 +286,34 @@ void server_handle_k(void) {
   state = KILLED;
 }
 
+//------------------------------------------------------------------------------
+// Peripheral registers get the widest access the address and length allow,
+// GDB reads a 16-bit register as "m addr,2". Memory goes the word path and
+// its caches.
+
+static bool server_mem_read(uint32_t addr, uint8_t *buf, size_t size) {
+  if (addr < CTX_PERIPH_ADDR || !((addr | size) & 3))
+    return ctx_read(addr, buf, size);
+  if (!((addr | size) & 1))
+    return ctx_get_block16(addr, (uint16_t *)buf, size / 2);
+  return ctx_get_block8(addr, buf, size);
+}
+
+//------------------------------------------------------------------------------
+
+static bool server_mem_write(uint32_t addr, const uint8_t *buf, size_t size) {
+  if (addr < CTX_PERIPH_ADDR || !((addr | size) & 3))
+    return ctx_write(addr, buf, size);
+  if (!((addr | size) & 1))
+    return ctx_set_block16(addr, (const uint16_t *)buf, size / 2);
+  return ctx_set_block8(addr, buf, size);
+}
+
 //------------------------------------------------------------------------------
 // Read memory
 
 void server_handle_m(void) {
-  uint32_t buf[256];
+  uint8_t buf[1024];
 
   packet_expect(&recv, 'm');
   int src = packet_take_hex(&recv);
@@ -304,39 +329,13 @@ void server_handle_m(void) {
   packet_clear(&send);
 
   while (len > 0) {
-    if (len == 2) {
-      uint16_t data;
-      if (!ctx_get_mem16(src, &data))
-        return;
-      packet_put_hex_u16(&send, data);
-      src += 2;
-      len -= 2;
-    } else if (len == 4) {
-      uint32_t data;
-      if (!ctx_get_mem32(src, &data))
-        return;
-      packet_put_hex_u32(&send, data);
-      src += 4;
-      len -= 4;
-    } else if (!(src & 3) && len >= 4) {
-      int chunk = len & ~3;
-      if (chunk > sizeof(buf))
-        chunk = sizeof(buf);
-
-      if (!ctx_get_block(src, buf, count_of(buf)))
-        return;
-      packet_put_hex_buf(&send, (uint8_t*)buf, chunk);
-      src += chunk;
-      len -= chunk;
-    } else {
-      uint8_t data;
-      if (!ctx_get_mem8(src, &data))
-        return;
-
-      packet_put_hex_u8(&send, data);
-      src++;
-      len--;
-    }
+    size_t chunk = len < sizeof(buf) ? len : sizeof(buf);
+    if (!server_mem_read(src, buf, chunk))
+      return;
+
+    packet_put_hex_buf(&send, buf, chunk);
+    src += chunk;
+    len -= chunk;
   }
 
   send_valid = true;
@@ -349,7 +348,7 @@ void server_handle_m(void) {
 // Does GDB also uses this for flash write? No, I don't think so.
 
 void server_handle_M(void) {
-  uint32_t buf[256];
+  uint8_t buf[1024];
 
   packet_expect(&recv, 'M');
   uint32_t dst = packet_take_hex(&recv);
@@ -363,25 +362,15 @@ void server_handle_M(void) {
     return;
   }
 
-  while (len) {
-    if (!(dst & 3) && len >= 4) {
-      int chunk = len & ~3;
-      if (chunk > sizeof(buf))
-        chunk = sizeof(buf);
-
-      packet_take_hex_to_buf(&recv, (uint8_t*)buf, chunk);
-      ctx_set_block(dst, buf, count_of(buf));
-      dst += chunk;
-      len -= chunk;
-    } else {
-      uint8_t x = (uint8_t)packet_take_hex_digits(&recv, 8);
-      ctx_set_mem8(dst, x);
-      dst += 1;
-      len -= 1;
-    }
+  bool ok = true;
+  while (len && ok) {
+    uint32_t chunk = len < sizeof(buf) ? len : sizeof(buf);
+    ok = packet_take_hex_to_buf(&recv, buf, chunk) && server_mem_write(dst, buf, chunk);
+    dst += chunk;
+    len -= chunk;
   }
 
-  if (recv.error)
+  if (!ok)
     server_set_resp("E01", 3);
   else
     server_set_resp("OK", 2);
@@ -400,13 +389,8 @@ void server_handle_p(void) {
     packet_clear(&send);
 
     uint32_t reg;
-    if (gpr < gpr_max) {
-      if (!gpr_get(gpr, &reg))
-        return;
-    } else {
-      if (!csr_get_dpc(&reg))
-        return;
-    }
+    if (!ctx_get_reg(gpr < gpr_max ? gpr : CTX_REG_PC, &reg))
+      return;
 
     packet_put_hex_u32(&send, reg);
     send_valid = true;
@@ -425,10 +409,7 @@ void server_handle_P(void) {
   uint32_t value = packet_take_hex(&recv);
 
   if (!recv.error) {
-    if (regnum < gpr_max)
-      gpr_set(regnum, value);
-    else
-      csr_set_dpc(value);
+    ctx_set_reg(regnum < gpr_max ? regnum : CTX_REG_PC, value);
 
     server_set_resp("OK", 2);
   }
@@ -466,6 +447,33 @@ void server_handle_q(void) {
     // FIXME: we're ignoring the contents of qSupported
     recv.pos = recv.len;
     server_set_resp("PacketSize=32768;qXfer:memory-map:read+", 39);
+  } else if (packet_match_prefix(&recv, "qSearch:memory:")) {
+    // -> qSearch:memory:address;length;search-pattern
+    // The target scans the range, see ctx_find
+    // Reply: ‘0’ not found, ‘1,address’ found, ‘E NN’ error
+    uint32_t addr = packet_take_hex(&recv);
+    packet_expect(&recv, ';');
+    uint32_t length = packet_take_hex(&recv);
+    packet_expect(&recv, ';');
+
+    const uint8_t *pattern = packet_ptr(&recv);
+    size_t len = recv.len - recv.pos;
+    recv.pos = recv.len;
+
+    uint32_t found;
+    int ret = recv.error ? -1 : ctx_find(addr, length, pattern, len, &found);
+    if (ret < 0)
+      server_set_resp("E01", 3);
+    else if (!ret)
+      server_set_resp("0", 1);
+    else {
+      packet_clear(&send);
+      packet_put_buf(&send, "1,", 2);
+      // The address goes out as a number, most significant byte first
+      for (int8_t shift = 24; shift >= 0; shift -= 8)
+        packet_put_hex_u8(&send, found >> shift);
+      send_valid = true;
+    }
   } else if (packet_match_prefix(&recv, "qXfer:")) {
     if (packet_match_prefix(&recv, "memory-map:read::")) {
       int offset = packet_take_hex(&recv);
@@ -490,6 +498,11 @@ void server_handle_q(void) {
     if (packet_match_prefix_hex(&recv, "reset")) {
       ctx_reset();
       server_set_resp("OK", 2);
+    } else if (packet_match_prefix_hex(&recv, "flush")) {
+      // Drop the flash mirror and the memory cache
+      ctx_mirror_flush();
+      ctx_cache_flush();
+      server_set_resp("OK", 2);
     }
   }
 
@@ -645,12 +658,12 @@ void server_flash_erase(uint32_t addr, uint32_t size) {
       size -= size;
     } else if (!(addr % CH32_FLASH_SECTOR_SIZE) && size >= CH32_FLASH_SECTOR_SIZE) {
       LOG("erase sector %08X\n", addr);
-      flash_erase_sector(addr);
+      flash_erase_sector((addr - CH32_FLASH_ADDR) / CH32_FLASH_SECTOR_SIZE);
       addr += CH32_FLASH_SECTOR_SIZE;
       size -= CH32_FLASH_SECTOR_SIZE;
     } else if (!(addr % CH32_FLASH_PAGE_SIZE) && size >= CH32_FLASH_PAGE_SIZE) {
       LOG("erase page %08X\n", addr);
-      flash_erase_page(addr);
+      flash_erase_page((addr - CH32_FLASH_ADDR) / CH32_FLASH_PAGE_SIZE);
       addr += CH32_FLASH_PAGE_SIZE;
       size -= CH32_FLASH_PAGE_SIZE;
     } else
@@ -1,221 +1,1177 @@
 #include <stdio.h>
+#include <string.h>
 #include <hardware/clocks.h>
+#include <hardware/dma.h>
+#include <hardware/irq.h>
 #include <hardware/sync.h>
 #include <pico/time.h>
 
 #include "out/swio.pio.h"
 #include "context.h"
 #include "option.h"
+#include "trace.h"
 #include "utils.h"
 #include "vendor.h"
 
 //------------------------------------------------------------------------------
 
 #define PICO_SWIO_PIN  27
+#define SWIO_TICK      100  // Default PIO clock period (ns), see swio.pio
+
+#if SWIO_TRACE
+#define SWIO_TRACE_ADD(addr, read, data)  trace_add(addr, read, data)
+#else
+#define SWIO_TRACE_ADD(addr, read, data)
+#endif
 
 //------------------------------------------------------------------------------
 
 static PIO pio;
 static uint sm, offset;
+static swio_mode mode;
 uint16_t dm_data_addr;
 
+// Link checks, see swio_get()
+static bool link_check;
+static bool link_error;  // Latched by swio_failed(), see swio_link_ok()
+static uint32_t autoexec = ~0u;  // Last ABSTRACTAUTO written, unknown = all set
+static uint32_t last_status;     // Last DM_STATUS seen by dm_status_wait()
+static swio_stats stats;
+static uint32_t throughput;  // B/s, measured by swio_reset()
+
+// Last values written to registers without write side effects
+typedef enum {
+  SHADOW_CONTROL,
+  SHADOW_ABSTRACTAUTO,
+  SHADOW_DATA1,
+  SHADOW_MAX
+} swio_shadow_reg;
+
+static uint32_t shadow[SHADOW_MAX];
+static uint8_t shadow_valid;  // Bit mask of swio_shadow_reg
+
+// Gang, target 0 is the main state machine
+typedef struct {
+  PIO pio;
+  uint sm;
+  uint8_t pin;
+  bool linked;        // Verified on attach
+  uint32_t diverged;  // Reads that didn't match target 0
+  uint8_t first;      // Register of the first mismatch
+} swio_target;
+
+static swio_target gang[SWIO_GANG_MAX];
+static uint8_t gang_count = 1;
+static PIO gang_pio;      // Other PIO block, NULL if not used
+static uint gang_offset;  // Program offset in gang_pio
+
+// Kind of the last abstract command, see dm_abstractcs_wait()
+static wait_class command_class = WAIT_REGISTER;
+
+// Timing, see swio_calibrate()
+static uint8_t tick = SWIO_TICK;  // PIO clock period (ns)
+static int8_t sample = -1;        // Delay of the release instruction, -1 = as assembled
+
+// Transaction queue
+static int dma_tx, dma_rx;
+static uint32_t queue_tx[SWIO_QUEUE_MAX * 2];
+static uint32_t queue_rx[SWIO_QUEUE_MAX];
+static volatile bool queue_busy;
+
+typedef struct {
+  const pio_program_t *program;
+  pio_sm_config (*get_config)(uint offset);
+  const char *name;
+  uint8_t release;  // Offset of the instruction releasing the read start pulse
+  uint8_t sample;   // Offset of the instruction sampling the pin
+} swio_prog;
+
+// Only one program fits into the PIO instruction memory, the other one is
+// swapped in by swio_load()
+static const swio_prog swio_progs[] = {
+  [SWIO_NORMAL] = { &singlewire_program,      singlewire_program_get_default_config,      "normal",
+                    singlewire_offset_release, singlewire_offset_sample },
+  [SWIO_FAST]   = { &singlewire_fast_program, singlewire_fast_program_get_default_config, "fast",
+                    singlewire_fast_offset_release, singlewire_fast_offset_sample }
+};
+
 //------------------------------------------------------------------------------
+// Side-set uses 1 bit, the remaining 4 bits of the field are the delay
 
-bool swio_init(void) {
-  // Find next free PIO block
-  if (!pio_claim_free_sm_and_add_program(&singlewire_program, &pio, &sm, &offset)) {
-    print_r(0, "swio: failed to claim a free PIO state machine\n");
-    return false;
-  }
+#define PIO_DELAY_LSB   8
+#define PIO_DELAY_MASK  (0xFu << PIO_DELAY_LSB)
 
-  // Get program-specific default config
-  pio_sm_config c = singlewire_program_get_default_config(offset);
-  sm_config_set_set_pins(&c, PICO_SWIO_PIN, 1);
-  sm_config_set_out_pins(&c, PICO_SWIO_PIN, 1);
-  sm_config_set_in_pins(&c, PICO_SWIO_PIN);
-  sm_config_set_sideset_pins(&c, PICO_SWIO_PIN);
-  sm_config_set_sideset(&c, 1, false, true);
+static inline uint8_t pio_instr_delay(uint16_t instr) {
+  return (instr & PIO_DELAY_MASK) >> PIO_DELAY_LSB;
+}
+
+static inline uint16_t pio_instr_set_delay(uint16_t instr, uint8_t delay) {
+  return (instr & ~PIO_DELAY_MASK) | (delay << PIO_DELAY_LSB);
+}
+
+//------------------------------------------------------------------------------
+// Number of ticks between the release and the next start pulse available to
+// place the sample point
+
+static uint8_t swio_window(void) {
+  const swio_prog *p = &swio_progs[mode];
+  const uint16_t *instr = p->program->instructions;
+  return pio_instr_delay(instr[p->release]) + pio_instr_delay(instr[p->sample]);
+}
+
+//------------------------------------------------------------------------------
+
+static inline float swio_clkdiv(void) {
+  return clock_get_hz(clk_sys) * (tick / 1e9f);
+}
+
+//------------------------------------------------------------------------------
+// Move the sample point, the read loop time stays the same
+
+static void swio_sample_patch(PIO block, uint prog_offset) {
+  const swio_prog *p = &swio_progs[mode];
+  const uint16_t *instr = p->program->instructions;
+
+  uint8_t window = swio_window();
+  uint8_t release = sample < 0 ? pio_instr_delay(instr[p->release]) : sample;
+
+  block->instr_mem[prog_offset + p->release] = pio_instr_set_delay(instr[p->release], release);
+  block->instr_mem[prog_offset + p->sample] = pio_instr_set_delay(instr[p->sample], window - release);
+}
+
+//------------------------------------------------------------------------------
+
+static void swio_sample_apply(void) {
+  swio_sample_patch(pio, offset);
+  if (gang_pio)
+    swio_sample_patch(gang_pio, gang_offset);
+}
+
+//------------------------------------------------------------------------------
+
+static void swio_sm_config(pio_sm_config *c, uint8_t pin) {
+  sm_config_set_set_pins(c, pin, 1);
+  sm_config_set_out_pins(c, pin, 1);
+  sm_config_set_in_pins(c, pin);
+  sm_config_set_sideset_pins(c, pin);
+  sm_config_set_sideset(c, 1, false, true);
 
   // Configure pin behaviors
-  sm_config_set_out_shift(&c, false, false, 32);  // MSB first
-  sm_config_set_in_shift(&c, false, true, 32);    // MSB first 
+  sm_config_set_out_shift(c, false, false, 32);  // MSB first
+  sm_config_set_in_shift(c, false, true, 32);    // MSB first 
+
+  // Set clock divider (default 100ns period = 10MHz)
+  sm_config_set_clkdiv(c, swio_clkdiv());
+}
+
+//------------------------------------------------------------------------------
 
-  // Set clock divider (100ns period = 10MHz)
-  float div = clock_get_hz(clk_sys) / 10000000.0f;
-  sm_config_set_clkdiv(&c, div);
+static void swio_target_init(const swio_target *t) {
+  uint prog_offset = t->pio == pio ? offset : gang_offset;
+
+  // Get program-specific default config
+  pio_sm_config c = swio_progs[mode].get_config(prog_offset);
+  swio_sm_config(&c, t->pin);
 
   // Initialize state machine
-  pio_sm_init(pio, sm, offset, &c);
-  pio_sm_set_pins(pio, sm, 0);
+  pio_sm_init(t->pio, t->sm, prog_offset, &c);
+  pio_sm_set_pins(t->pio, t->sm, 0);
+
+  // Start state machine
+  pio_sm_set_enabled(t->pio, t->sm, true);
+}
+
+//------------------------------------------------------------------------------
+
+static void swio_sm_init(void) {
+  for (int i = 0; i < gang_count; i++)
+    swio_target_init(&gang[i]);
+
+  swio_sample_apply();
+}
+
+//------------------------------------------------------------------------------
+
+static void swio_queue_irq(void) {
+  bool done = false;
+
+  if (dma_channel_get_irq1_status(dma_tx)) {
+    dma_channel_acknowledge_irq1(dma_tx);
+    done = true;
+  }
+
+  if (dma_channel_get_irq1_status(dma_rx)) {
+    dma_channel_acknowledge_irq1(dma_rx);
+    done = true;
+  }
+
+  if (done) {
+    queue_busy = false;
+    __sev();
+  }
+}
+
+//------------------------------------------------------------------------------
+// NOTE: The state machine is never reclaimed, so the FIFO addresses and DREQs
+// stay valid when swio_load() swaps the program.
+
+static void swio_queue_init(void) {
+  dma_tx = dma_claim_unused_channel(true);
+  dma_rx = dma_claim_unused_channel(true);
+
+  // TX: memory -> PIO TX FIFO
+  dma_channel_config c = dma_channel_get_default_config(dma_tx);
+  channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+  channel_config_set_read_increment(&c, true);
+  channel_config_set_write_increment(&c, false);
+  channel_config_set_dreq(&c, pio_get_dreq(pio, sm, true));
+  dma_channel_configure(dma_tx, &c, &pio->txf[sm], queue_tx, 0, false);
+
+  // RX: PIO RX FIFO -> memory
+  c = dma_channel_get_default_config(dma_rx);
+  channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+  channel_config_set_read_increment(&c, false);
+  channel_config_set_write_increment(&c, true);
+  channel_config_set_dreq(&c, pio_get_dreq(pio, sm, false));
+  dma_channel_configure(dma_rx, &c, queue_rx, &pio->rxf[sm], 0, false);
+
+  irq_add_shared_handler(DMA_IRQ_1, swio_queue_irq, PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY);
+  irq_set_enabled(DMA_IRQ_1, true);
+}
+
+//------------------------------------------------------------------------------
+
+bool swio_init(void) {
+  // Find next free PIO block
+  mode = SWIO_NORMAL;
+  if (!pio_claim_free_sm_and_add_program(swio_progs[mode].program, &pio, &sm, &offset)) {
+    print_r(0, "swio: failed to claim a free PIO state machine\n");
+    return false;
+  }
 
   // Set GPIO drive characteristics
   gpio_set_drive_strength(PICO_SWIO_PIN, GPIO_DRIVE_STRENGTH_2MA);
   gpio_set_slew_rate(PICO_SWIO_PIN, GPIO_SLEW_RATE_SLOW);
 
-  // Start state machine
-  pio_sm_set_enabled(pio, sm, true);
+  gang[0] = (swio_target) { pio, sm, PICO_SWIO_PIN };
+  swio_sm_init();
+  swio_queue_init();
 
   return true;
 }
 
 //------------------------------------------------------------------------------
 
+static void swio_load(swio_mode m) {
+  if (m == mode)
+    return;
+
+  // Replace the program, the FIFOs are cleared by pio_sm_init()
+  for (int i = 0; i < gang_count; i++)
+    pio_sm_set_enabled(gang[i].pio, gang[i].sm, false);
+
+  if (gang_pio) {
+    pio_remove_program(gang_pio, swio_progs[mode].program, gang_offset);
+    gang_offset = pio_add_program(gang_pio, swio_progs[m].program);
+  }
+
+  pio_remove_program(pio, swio_progs[mode].program, offset);
+
+  mode = m;
+  offset = pio_add_program(pio, swio_progs[mode].program);
+  swio_sm_init();
+}
+
+//------------------------------------------------------------------------------
+// NOTE: Only called between transactions, the state machine waits in 'pull'
+
+static void swio_timing_set(uint8_t new_tick, int8_t new_sample) {
+  tick = new_tick;
+  sample = new_sample;
+
+  for (int i = 0; i < gang_count; i++) {
+    pio_sm_set_clkdiv(gang[i].pio, gang[i].sm, swio_clkdiv());
+    pio_sm_clkdiv_restart(gang[i].pio, gang[i].sm);
+  }
+  swio_sample_apply();
+}
+
+//------------------------------------------------------------------------------
+
 static inline void swio_pulse(void) {
-  // Reinitialize the GPIO pin: set the pin to SIO function, input direction,
-  // and explicitly clears the output latch to 0 (LOW).
-  gpio_init(PICO_SWIO_PIN);
+  // All targets are reset together
+  uint32_t pins = 0;
+  for (int i = 0; i < gang_count; i++)
+    pins |= 1u << gang[i].pin;
+
+  // Reinitialize the GPIO pins: set the pins to SIO function, input direction,
+  // and explicitly clears the output latches to 0 (LOW).
+  gpio_init_mask(pins);
 
   // Save current interrupt state and disable all interrupts.
   // This guarantees that the timing below is not disturbed by IRQs.
   uint32_t state = save_and_disable_interrupts();
 
-  // Switch the pin to output mode. Because the output latch is already 0,
-  // the pin immediately drives LOW with no glitch or jitter.
-  gpio_set_dir(PICO_SWIO_PIN, GPIO_OUT);
+  // Switch the pins to output mode. Because the output latch is already 0,
+  // the pins immediately drive LOW with no glitch or jitter.
+  gpio_set_dir_out_masked(pins);
 
   // Hold the pin LOW for a precise number of CPU cycles.
   // 500 cycles correspond to ~8 microseconds at 125 MHz.
   delay_cycles(500);
 
-  // Set the GPIO pin to input mode. This disables the output driver.
-  gpio_set_dir(PICO_SWIO_PIN, GPIO_IN);
+  // Set the GPIO pins to input mode. This disables the output drivers.
+  gpio_set_dir_in_masked(pins);
+
+  // Restore interrupt state and enable all interrupts.
+  restore_interrupts(state);
+
+  // Reconfigure the given pins for use by their PIO instances.
+  for (int i = 0; i < gang_count; i++)
+    pio_gpio_init(gang[i].pio, gang[i].pin);
+}
+
+//------------------------------------------------------------------------------
+
+static inline void swio_config(uint32_t value) {
+  // Enable the shadow configuration register output to position 1
+  dm_set_shdwcfgr(value | DMCF_OUTEN | DMCF_KEY(0x5AA5));
+
+  // Update the shadow configuration register output enable bit to the
+  // CFGR, and leave the other bits of the configuration register unchanged
+  dm_set_cfgr(value | DMCF_OUTEN | DMCF_KEY(0x5AA5));
+}
+
+//------------------------------------------------------------------------------
+
+static inline bool swio_verify(void) {
+  // Verify SWIO link by reading CPBR
+  dm_cpbr cpbr = dm_get_cpbr();
+  if (cpbr.raw != (DMCP_TDIV | DMCP_OUTSTA | DMCP_VERSION(1))) {
+    LOG_R("swio: failed (%08X)\n", cpbr.raw);
+    return false;
+  }
+
+  // Verify number of prog registers
+  dm_abstractcs abstractcs = dm_get_abstractcs();
+  if (abstractcs.b.PROGBUFSIZE < 8) {
+    LOG_R("swio: target has only %d prog regs\n", abstractcs.b.PROGBUFSIZE);
+    return false;
+  }
+
+  // Verify number of data registers
+  if (abstractcs.b.DATACOUNT < 2) {
+    LOG_R("swio: target status bityhas only %d data regs\n", abstractcs.b.DATACOUNT);
+    return false;
+  }
+
+  // Verify data0 offset address
+  dm_hartinfo hartinfo = dm_get_hartinfo();
+  if (!hartinfo.b.DATAACCESS) {
+    LOG_R("swio: wrong chip (%08X)\n", hartinfo.raw);
+    return false;
+  }
+
+  // Update stubs
+  dm_data_addr = hartinfo.b.DATAADDR;
+
+  uint16_t op_code = (dm_data_addr << 4) | 4;
+  ctx_set_stub_opcode(op_code);
+  optb_set_stub_opcode(op_code);
+  return true;
+}
+
+//------------------------------------------------------------------------------
+
+
+// Reads CPBR from every gang target on its own, targets without a link are
+// left out of the broadcast
+
+static void swio_gang_probe(void) {
+  for (int i = 1; i < gang_count; i++) {
+    swio_target *t = &gang[i];
+    pio_sm_put_blocking(t->pio, t->sm, DM_CPBR | 1);
+    uint32_t cpbr = pio_sm_get_blocking(t->pio, t->sm);
+
+    t->linked = cpbr == (DMCP_TDIV | DMCP_OUTSTA | DMCP_VERSION(1));
+    t->diverged = 0;
+    t->first = 0;
+    if (!t->linked)
+      LOG_Y("swio: gang target %d (GP%d) has no link\n", i, t->pin);
+  }
+}
+
+//------------------------------------------------------------------------------
+
+static bool swio_enter(swio_mode m) {
+  shadow_valid = 0;
+  for (int i = 0; i < gang_count; i++)
+    gang[i].linked = true;
+
+  // The pulse resets the interface, the target starts in normal mode
+  swio_load(SWIO_NORMAL);
+  swio_pulse();
+  swio_timing_set(SWIO_TICK, -1);
+  swio_config(0);
+
+  // TDIV = 1 and SOPN = 8 encode as 0, swio_config(0) above already selected
+  // them, so fast mode only swaps the PIO program
+  if (m == SWIO_FAST)
+    swio_load(SWIO_FAST);
+
+  swio_gang_probe();
+  return swio_verify();
+}
+
+//------------------------------------------------------------------------------
+
+static bool swio_attach(void) {
+  // Calibration has to see the raw link
+  link_check = false;
+  autoexec = ~0u;
+  memset(&stats, 0, sizeof(stats));
+  shadow_valid = 0;
+
+  if (!swio_enter(SWIO_NORMAL))
+    return false;
+
+  // Fast mode needs TDIV = 1 and the stop sign factor of 8, the stop bit of
+  // singlewire_fast is too short for anything longer. swio_verify() above
+  // already accepted only a CPBR that offers both.
+  if (swio_enter(SWIO_FAST))
+    return true;
+
+  // Fall back to normal mode
+  LOG_Y("swio: fast mode failed\n");
+  return swio_enter(SWIO_NORMAL);
+}
+
+//==============================================================================
+// Calibration
+
+static const uint8_t swio_ticks[] = { 150, 125, 110, 100, 90, 80, 70, 60 };  // ns, slowest first
+
+//------------------------------------------------------------------------------
+// The reads go first: a write with broken timing may hit another register.
+
+static bool swio_check(uint32_t cpbr, uint32_t hartinfo) {
+  static const uint32_t patterns[] = {
+    0x00000000, 0xFFFFFFFF, 0xAAAAAAAA, 0x55555555, 0x0F0F0F0F, 0x12345678
+  };
+
+  if (dm_get_cpbr().raw != cpbr || dm_get_hartinfo().raw != hartinfo)
+    return false;
+
+  for (size_t i = 0; i < count_of(patterns); i++) {
+    dm_set_data0(patterns[i]);
+    if (dm_get_data0() != patterns[i])
+      return false;
+  }
+
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Sweeps the PIO clock and the sample point. A clock passes if at least two
+// neighbouring sample points work; the fastest passing clock is backed off by
+// one step if the slower one passes too, the sample point is centered.
+
+static bool swio_calibrate(void) {
+  uint32_t cpbr = dm_get_cpbr().raw;
+  uint32_t hartinfo = dm_get_hartinfo().raw;
+
+  int8_t centers[count_of(swio_ticks)];
+  uint8_t window = swio_window();
+
+  for (size_t i = 0; i < count_of(swio_ticks); i++) {
+    uint8_t run = 0, run_max = 0;
+    centers[i] = -1;
+
+    for (uint8_t s = 0; s <= window; s++) {
+      swio_timing_set(swio_ticks[i], s);
+      if (swio_check(cpbr, hartinfo)) {
+        run++;
+        if (run > run_max) {
+          run_max = run;
+          centers[i] = s - (run - 1) / 2;
+        }
+        continue;
+      }
+
+      // Resync the link at the default timing
+      run = 0;
+      if (!swio_enter(mode))
+        return false;
+    }
+
+    if (run_max < 2)
+      centers[i] = -1;
+  }
+
+  // Fastest passing clock
+  int best = -1;
+  for (size_t i = 0; i < count_of(swio_ticks); i++)
+    if (centers[i] >= 0)
+      best = i;
+
+  if (best < 0) {
+    LOG_Y("swio: calibration failed\n");
+    swio_timing_set(SWIO_TICK, -1);
+    return true;
+  }
+
+  // Margin
+  if (best > 0 && centers[best - 1] >= 0)
+    best--;
+
+  swio_timing_set(swio_ticks[best], centers[best]);
+  if (swio_check(cpbr, hartinfo))
+    return true;
+
+  LOG_Y("swio: calibrated timing failed\n");
+  return swio_enter(mode);
+}
+
+//------------------------------------------------------------------------------
+
+// Queued CPBR reads at the final timing, CPBR has no side effects
+
+static void swio_throughput_measure(void) {
+  swio_xfer xfers[SWIO_QUEUE_MAX];
+  for (size_t i = 0; i < count_of(xfers); i++)
+    xfers[i] = (swio_xfer) { DM_CPBR, true, 0 };
+
+  uint32_t start = time_us_32();
+  swio_transfer(xfers, count_of(xfers));
+  uint32_t elapsed = time_us_32() - start;
+
+  throughput = elapsed ? sizeof(uint32_t) * count_of(xfers) * 1000000ull / elapsed : 0;
+}
+
+//------------------------------------------------------------------------------
+
+bool swio_reset(void) {
+  if (!swio_attach())
+    return false;
+
+#if SWIO_CALIBRATE
+  // The gang runs at the default timing
+  if (gang_count == 1 && !swio_calibrate())
+    return false;
+#endif
+
+  swio_throughput_measure();
+
+  // Autoexec state of the previous session
+  autoexec = dm_get_abstractauto().raw;
+  link_check = SWIO_CHECKED;
+  link_error = false;
+
+  // Reset debug module on target
+  dm_set_control(DMC_ACTIVE);
+
+  // Initiate a core reset request
+  dm_set_control(DMC_ACTIVE | DMC_NDMRESET);
+  if (!dm_status_wait(DMS_ANYHAVERESET | DMS_ALLHAVERESET, DMS_ANYHAVERESET | DMS_ALLHAVERESET))
+    return false;
+
+  // Clear the reset signal
+  dm_set_control(DMC_ACTIVE);
+
+  // A 260+ µs delay is required here to ensure the HAVERESET status is cleared
+  sleep_us(400);
+
+  // Clear the reset status signal
+  dm_set_control(DMC_ACTIVE | DMC_ACKHAVERESET);
+  return true;
+//  return dm_status_wait(DMS_ANYHAVERESET | DMS_ALLHAVERESET, 0);
+}
+
+//------------------------------------------------------------------------------
+
+// reset = the hart was reset since the last halt (NRST, watchdog, software),
+// the status is acknowledged with the write that clears HALTREQ.
+
+bool swio_halt(bool *reset) {
+  dm_set_control(DMC_ACTIVE | DMC_HALTREQ);
+  if (!dm_status_wait(DMS_ANYHALTED | DMS_ALLHALTED, DMS_ANYHALTED | DMS_ALLHALTED))
+    return false;
+
+  *reset = last_status & DMS_ANYHAVERESET;
+  dm_set_control(*reset ? DMC_ACTIVE | DMC_ACKHAVERESET : DMC_ACTIVE);
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// NOTE: DMC_RESUMEREQ is cleared automatically once the MCU resumes execution
+
+inline bool swio_resume(void) {
+  dm_set_control(DMC_ACTIVE | DMC_RESUMEREQ);
+  return dm_status_wait(DMS_ANYRUNNING | DMS_ALLRUNNING, DMS_ANYRUNNING | DMS_ALLRUNNING);
+}
+
+//------------------------------------------------------------------------------
+
+inline bool swio_step(void) {
+  dm_set_control(DMC_ACTIVE | DMC_RESUMEREQ);
+  return dm_status_wait(DMS_ANYRESUMEACK | DMS_ALLRESUMEACK, DMS_ANYRESUMEACK | DMS_ALLRESUMEACK);
+}
+
+//==============================================================================
+// Transfer data
+
+static uint32_t swio_gang_get(uint8_t addr) {
+  for (int i = 0; i < gang_count; i++)
+    if (gang[i].linked)
+      pio_sm_put_blocking(gang[i].pio, gang[i].sm, addr | 1);
+
+  uint32_t data = pio_sm_get_blocking(pio, sm);
+  uint32_t reduced = data;
+
+  for (int i = 1; i < gang_count; i++) {
+    swio_target *t = &gang[i];
+    if (!t->linked)
+      continue;
+
+    uint32_t value = pio_sm_get_blocking(t->pio, t->sm);
+    if (addr == DM_STATUS)
+      reduced &= value;
+    else if (addr == DM_ABSTRACTCS)
+      reduced |= value;
+    else if (value != data && !t->diverged++)
+      t->first = addr;
+  }
+
+  return reduced;
+}
+
+//------------------------------------------------------------------------------
+
+static void swio_gang_put(uint8_t addr, uint32_t data) {
+  for (int i = 0; i < gang_count; i++) {
+    if (!gang[i].linked)
+      continue;
+
+    pio_sm_put_blocking(gang[i].pio, gang[i].sm, addr);
+    pio_sm_put_blocking(gang[i].pio, gang[i].sm, ~data);
+  }
+}
+
+//------------------------------------------------------------------------------
+
+static inline uint32_t swio_get_raw(uint8_t addr) {
+  uint32_t data;
+  if (gang_count > 1)
+    data = swio_gang_get(addr);
+  else {
+    pio_sm_put_blocking(pio, sm, addr | 1);
+    data = pio_sm_get_blocking(pio, sm);
+  }
+
+  SWIO_TRACE_ADD(addr, true, data);
+  return data;
+}
+
+//------------------------------------------------------------------------------
+
+static inline void swio_put_raw(uint8_t addr, uint32_t data) {
+  SWIO_TRACE_ADD(addr, false, data);
+  if (gang_count > 1) {
+    swio_gang_put(addr, data);
+    return;
+  }
+
+  pio_sm_put_blocking(pio, sm, addr);
+  pio_sm_put_blocking(pio, sm, ~data);
+}
+
+//------------------------------------------------------------------------------
+// Autoexec bit of a data or progbuf register, 0 for the others
+
+static uint32_t swio_autoexec_bit(uint8_t addr) {
+  if (addr <= DM_DATA0 && addr >= DM_DATA(DM_DATA_MAX - 1) && !(addr & 1))
+    return DMAA_DATA((DM_DATA0 - addr) / 2);
+
+  if (addr <= DM_PROGBUF0 && addr >= DM_PROGBUF(DM_PROGBUFMAX - 1) && !(addr & 1))
+    return DMAA_PROGBUF((DM_PROGBUF0 - addr) / 2);
+
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// CONTROL is only shadowed without the action bits, RESUMEREQ clears itself
+// and the others must reach the target every time. COMMAND is never shadowed,
+// each write runs a command.
+
+#define SHADOW_CONTROL_ACTIONS  (DMC_HALTREQ | DMC_RESUMEREQ | DMC_ACKHAVERESET | DMC_NDMRESET)
+
+static int swio_shadow_index(uint8_t addr) {
+  switch (addr) {
+    case DM_CONTROL:       return SHADOW_CONTROL;
+    case DM_ABSTRACTAUTO:  return SHADOW_ABSTRACTAUTO;
+    case DM_DATA1:         return SHADOW_DATA1;
+  }
+
+  return -1;
+}
+
+//------------------------------------------------------------------------------
+
+static bool swio_shadow_hit(uint8_t addr, uint32_t data) {
+  int i = swio_shadow_index(addr);
+  if (i < 0 || !(shadow_valid & (1u << i)) || shadow[i] != data)
+    return false;
+
+  // An autoexec write has to go out
+  return !(autoexec & swio_autoexec_bit(addr));
+}
+
+//------------------------------------------------------------------------------
+// The stubs move the address in DATA1, so every command the access may start
+// invalidates it.
+
+static void swio_shadow_update(uint8_t addr, bool read, uint32_t data) {
+  if (addr == DM_COMMAND || (autoexec & swio_autoexec_bit(addr)))
+    shadow_valid &= ~(1u << SHADOW_DATA1);
+
+  if (read)
+    return;
+
+  if (addr == DM_ABSTRACTAUTO)
+    autoexec = data;
+  else if (addr == DM_COMMAND)
+    command_class = data & DMCM_POSTEXEC ? WAIT_PROGBUF : WAIT_REGISTER;
+
+  int i = swio_shadow_index(addr);
+  if (i < 0)
+    return;
+
+  if (addr == DM_CONTROL && (data & SHADOW_CONTROL_ACTIONS)) {
+    shadow_valid &= ~(1u << i);
+    return;
+  }
+
+  shadow[i] = data;
+  shadow_valid |= 1u << i;
+}
+
+//------------------------------------------------------------------------------
+
+inline void swio_shadow_invalidate(void) {
+  shadow_valid = 0;
+}
+
+//------------------------------------------------------------------------------
+// Registers that can be read twice without side effects. CONTROL, STATUS and
+// ABSTRACTCS are polled while they change, they would count as link errors.
+
+static bool swio_check_read(uint8_t addr) {
+  switch (addr) {
+    case DM_HARTINFO:
+    case DM_ABSTRACTAUTO:
+    case DM_CPBR:
+    case DM_CFGR:
+    case DM_SHDWCFGR:
+    case DM_CHIPID:
+      return true;
+  }
+
+  uint32_t bit = swio_autoexec_bit(addr);
+  return bit && !(autoexec & bit);
+}
+
+//------------------------------------------------------------------------------
+// Registers that read back what was written
+
+static inline bool swio_check_write(uint8_t addr) {
+  uint32_t bit = swio_autoexec_bit(addr);
+  return bit && !(autoexec & bit);
+}
+
+//------------------------------------------------------------------------------
+
+static void swio_failed(uint8_t addr, const char *op) {
+  stats.failures++;
+  shadow_valid = 0;
+  link_error = true;
+  LOG_R("swio: %s %s failed after %d retries\n", op, dm_str(addr), SWIO_RETRIES);
+}
+
+//------------------------------------------------------------------------------
+// The CH32V003 doesn't offer the CRC8 frame check (DMCP_CHECKSTA), so checked
+// transactions rely on redundancy instead: reads are repeated until two agree
+// and writes are read back. Registers with side effects go out unchecked.
+
+static uint32_t swio_get_checked(uint8_t addr) {
+  uint32_t data = swio_get_raw(addr);
+  stats.checked++;
+
+  for (int i = 0; i < SWIO_RETRIES; i++) {
+    uint32_t again = swio_get_raw(addr);
+    if (again == data)
+      return data;
+
+    if (!i)
+      stats.errors++;
+    stats.retries++;
+    data = again;
+  }
+
+  swio_failed(addr, "get");
+  return data;
+}
+
+//------------------------------------------------------------------------------
+
+uint32_t swio_get(uint8_t addr) {
+  uint32_t data = link_check && swio_check_read(addr) ?
+                  swio_get_checked(addr) : swio_get_raw(addr);
+  swio_shadow_update(addr, true, data);
+
+#if SWIO_DUMP
+  const char *name = dm_str(addr);
+  print_c(0, "%s -> %08X\n", name, data);
+#endif
+  return data;
+}
+
+//------------------------------------------------------------------------------
+
+void swio_put(uint8_t addr, uint32_t data) {
+#if SWIO_DUMP
+  const char *name = dm_str(addr);
+  print_c(0, "%s <- %08X\n", name, data);
+#endif
+
+  // Write-through shadow, drop writes the target already has
+  if (swio_shadow_hit(addr, data)) {
+    stats.skipped++;
+    return;
+  }
+
+  swio_put_raw(addr, data);
+  swio_shadow_update(addr, false, data);
+
+  if (!link_check || !swio_check_write(addr))
+    return;
+
+  stats.checked++;
+  for (int i = 0; i < SWIO_RETRIES; i++) {
+    if (swio_get_raw(addr) == data)
+      return;
+
+    if (!i)
+      stats.errors++;
+    stats.retries++;
+    swio_put_raw(addr, data);
+  }
+
+  if (swio_get_raw(addr) != data)
+    swio_failed(addr, "put");
+}
+
+//------------------------------------------------------------------------------
+
+inline const swio_stats *swio_get_stats(void) {
+  return &stats;
+}
+
+//------------------------------------------------------------------------------
+
+bool swio_link_ok(void) {
+  bool ok = !link_error;
+  link_error = false;
+  return ok;
+}
+
+//------------------------------------------------------------------------------
+// For autoexec streams whose kicks aren't what the COMMAND write said, e.g.
+// the flash write stub that ends every page with the page program.
+
+inline void swio_set_command_class(wait_class cls) {
+  command_class = cls;
+}
+
+//------------------------------------------------------------------------------
+// Block mode header, see swio.pio
+
+#define SWIO_HEADER(addr, count)  ((((count) - 1) << 8) | (addr))
+
+//------------------------------------------------------------------------------
+// Sends tx words from queue_tx and receives rx words into queue_rx, the CPU
+// sleeps until the last DMA channel signals completion.
+
+static void swio_queue_kick(size_t tx, size_t rx) {
+  // Completion is signalled by the channel that finishes last
+  dma_channel_set_irq1_enabled(dma_tx, !rx);
+  dma_channel_set_irq1_enabled(dma_rx, rx);
+  queue_busy = true;
+
+  if (rx)
+    dma_channel_transfer_to_buffer_now(dma_rx, queue_rx, rx);
+  dma_channel_transfer_from_buffer_now(dma_tx, queue_tx, tx);
+
+  while (queue_busy)
+    __wfe();
+}
+
+//------------------------------------------------------------------------------
+
+static void swio_queue_run(swio_xfer *xfers, size_t count) {
+  size_t tx = 0, rx = 0;
+
+  for (size_t i = 0; i < count; i++) {
+    swio_xfer *x = &xfers[i];
+    if (x->read) {
+      swio_shadow_update(x->addr, true, 0);
+      queue_tx[tx++] = x->addr | 1;
+      rx++;
+      continue;
+    }
+
+    // Consecutive writes to the same register share one header
+    size_t n = 1;
+    while (i + n < count && !x[n].read && x[n].addr == x->addr)
+      n++;
+
+    queue_tx[tx++] = SWIO_HEADER(x->addr, n);
+    for (size_t j = 0; j < n; j++) {
+#if SWIO_DUMP
+      const char *name = dm_str(x->addr);
+      print_c(0, "%s <- %08X\n", name, x[j].data);
+#endif
+      swio_shadow_update(x->addr, false, x[j].data);
+      queue_tx[tx++] = ~x[j].data;
+    }
+    i += n - 1;
+  }
+
+  swio_queue_kick(tx, rx);
+
+  // Copy results, the trace gets reads and writes in the order they went out
+  // with the completion time of the batch
+  rx = 0;
+  for (size_t i = 0; i < count; i++) {
+    swio_xfer *x = &xfers[i];
+    if (!x->read) {
+      SWIO_TRACE_ADD(x->addr, false, x->data);
+      continue;
+    }
+
+    x->data = queue_rx[rx++];
+    SWIO_TRACE_ADD(x->addr, true, x->data);
+#if SWIO_DUMP
+    const char *name = dm_str(x->addr);
+    print_c(0, "%s -> %08X\n", name, x->data);
+#endif
+  }
+}
+
+//------------------------------------------------------------------------------
+
+void swio_transfer(swio_xfer *xfers, size_t count) {
+  // The queue only feeds the first target
+  if (gang_count > 1) {
+    for (size_t i = 0; i < count; i++) {
+      if (xfers[i].read)
+        xfers[i].data = swio_get(xfers[i].addr);
+      else
+        swio_put(xfers[i].addr, xfers[i].data);
+    }
+    return;
+  }
 
-  // Restore interrupt state and enable all interrupts.
-  restore_interrupts(state);
+  while (count) {
+    size_t chunk = count < SWIO_QUEUE_MAX ? count : SWIO_QUEUE_MAX;
+    swio_queue_run(xfers, chunk);
 
-  // Reconfigure the given pin for use by the specified PIO instance.
-  pio_gpio_init(pio, PICO_SWIO_PIN);
+    xfers += chunk;
+    count -= chunk;
+  }
 }
 
 //------------------------------------------------------------------------------
+// Writes the words to one register as a PIO block
 
-static inline void swio_config(void) {
-  // Enable the shadow configuration register output to position 1
-  dm_set_shdwcfgr(DMCF_OUTEN | DMCF_KEY(0x5AA5));
+void swio_put_block(uint8_t addr, const uint32_t *data, size_t count) {
+  if (gang_count > 1) {
+    for (size_t i = 0; i < count; i++)
+      swio_put(addr, data[i]);
+    return;
+  }
 
-  // Update the shadow configuration register output enable bit to the
-  // CFGR, and leave the other bits of the configuration register unchanged
-  dm_set_cfgr(DMCF_OUTEN | DMCF_KEY(0x5AA5));
+  while (count) {
+    size_t chunk = count < count_of(queue_tx) - 1 ? count : count_of(queue_tx) - 1;
+    size_t tx = 0;
+
+    queue_tx[tx++] = SWIO_HEADER(addr, chunk);
+    for (size_t i = 0; i < chunk; i++) {
+#if SWIO_DUMP
+      const char *name = dm_str(addr);
+      print_c(0, "%s <- %08X\n", name, data[i]);
+#endif
+      swio_shadow_update(addr, false, data[i]);
+      SWIO_TRACE_ADD(addr, false, data[i]);
+      queue_tx[tx++] = ~data[i];
+    }
+
+    swio_queue_kick(tx, 0);
+    data += chunk;
+    count -= chunk;
+  }
 }
 
-//------------------------------------------------------------------------------
+//==============================================================================
+// Gang
 
-static inline bool swio_verify(void) {
-  // Verify SWIO link by reading CPBR
-  dm_cpbr cpbr = dm_get_cpbr();
-  if (cpbr.raw != (DMCP_TDIV | DMCP_OUTSTA | DMCP_VERSION(1))) {
-    LOG_R("swio: failed (%08X)\n", cpbr.raw);
-    return false;
+static void swio_gang_release(void) {
+  for (int i = 1; i < gang_count; i++) {
+    pio_sm_set_enabled(gang[i].pio, gang[i].sm, false);
+    pio_sm_unclaim(gang[i].pio, gang[i].sm);
+    gpio_init(gang[i].pin);
   }
 
-  // Verify number of prog registers
-  dm_abstractcs abstractcs = dm_get_abstractcs();
-  if (abstractcs.b.PROGBUFSIZE < 8) {
-    LOG_R("swio: target has only %d prog regs\n", abstractcs.b.PROGBUFSIZE);
-    return false;
+  if (gang_pio) {
+    pio_remove_program(gang_pio, swio_progs[mode].program, gang_offset);
+    gang_pio = NULL;
   }
 
-  // Verify number of data registers
-  if (abstractcs.b.DATACOUNT < 2) {
-    LOG_R("swio: target status bityhas only %d data regs\n", abstractcs.b.DATACOUNT);
-    return false;
+  gang_count = 1;
+}
+
+//------------------------------------------------------------------------------
+// Extra state machines come from the main PIO block first, then from the other
+// one with its own copy of the program.
+
+static bool swio_gang_claim(swio_target *t) {
+  int sm_free = pio_claim_unused_sm(pio, false);
+  if (sm_free >= 0) {
+    t->pio = pio;
+    t->sm = sm_free;
+    return true;
   }
 
-  // Verify data0 offset address
-  dm_hartinfo hartinfo = dm_get_hartinfo();
-  if (!hartinfo.b.DATAACCESS) {
-    LOG_R("swio: wrong chip (%08X)\n", hartinfo.raw);
+  PIO other = pio == pio0 ? pio1 : pio0;
+  sm_free = pio_claim_unused_sm(other, false);
+  if (sm_free < 0)
     return false;
-  }
 
-  // Update stubs
-  dm_data_addr = hartinfo.b.DATAADDR;
+  if (!gang_pio) {
+    if (!pio_can_add_program(other, swio_progs[mode].program)) {
+      pio_sm_unclaim(other, sm_free);
+      return false;
+    }
 
-  uint16_t op_code = (dm_data_addr << 4) | 4;
-  ctx_set_stub_opcode(op_code);
-  optb_set_stub_opcode(op_code);
+    gang_pio = other;
+    gang_offset = pio_add_program(other, swio_progs[mode].program);
+  }
+
+  t->pio = other;
+  t->sm = sm_free;
   return true;
 }
 
 //------------------------------------------------------------------------------
 
-bool swio_reset(void) {
-  swio_pulse();
-  swio_config();
+// Pins the firmware already drives or reads
 
-  if (!swio_verify())
-    return false;
+static uint32_t swio_gang_reserved(void) {
+  uint32_t mask = (1u << PICO_SWIO_PIN) | (1u << PICO_KEY_PIN);
+#ifdef PICO_DEFAULT_LED_PIN
+  mask |= 1u << PICO_DEFAULT_LED_PIN;
+#endif
+#ifdef PICO_DEFAULT_WS2812_PIN
+  mask |= 1u << PICO_DEFAULT_WS2812_PIN;
+#endif
+#ifdef PICO_DEFAULT_UART_TX_PIN
+  mask |= 1u << PICO_DEFAULT_UART_TX_PIN;
+#endif
+#ifdef PICO_DEFAULT_UART_RX_PIN
+  mask |= 1u << PICO_DEFAULT_UART_RX_PIN;
+#endif
+  return mask;
+}
 
-  // Reset debug module on target
-  dm_set_control(DMC_ACTIVE);
+//------------------------------------------------------------------------------
 
-  // Initiate a core reset request
-  dm_set_control(DMC_ACTIVE | DMC_NDMRESET);
-  if (!dm_status_wait(DMS_ANYHAVERESET | DMS_ALLHAVERESET, DMS_ANYHAVERESET | DMS_ALLHAVERESET))
+bool swio_gang_set(uint32_t pins) {
+  uint32_t refused = pins & ~((1u << NUM_BANK0_GPIOS) - 1);
+  if (refused) {
+    print_r(2, "gang: GP%d doesn't exist\n", __builtin_ctz(refused));
+    return false;
+  }
+
+  refused = pins & swio_gang_reserved();
+  if (refused) {
+    print_r(2, "gang: GP%d is in use\n", __builtin_ctz(refused));
     return false;
+  }
 
-  // Clear the reset signal
-  dm_set_control(DMC_ACTIVE);
+  if (__builtin_popcount(pins) > SWIO_GANG_MAX - 1) {
+    print_r(2, "gang: more than %d targets\n", SWIO_GANG_MAX);
+    return false;
+  }
 
-  // A 260+ µs delay is required here to ensure the HAVERESET status is cleared
-  sleep_us(400);
+  swio_gang_release();
 
-  // Clear the reset status signal
-  dm_set_control(DMC_ACTIVE | DMC_ACKHAVERESET);
-  return true;
-//  return dm_status_wait(DMS_ANYHAVERESET | DMS_ALLHAVERESET, 0);
-}
+  for (uint8_t pin = 0; pins; pin++, pins >>= 1) {
+    if (!(pins & 1))
+      continue;
 
-//------------------------------------------------------------------------------
+    swio_target *t = &gang[gang_count];
+    if (!swio_gang_claim(t)) {
+      print_r(2, "gang: no free state machine for GP%d\n", pin);
+      // No partial gang, back to the main target only
+      swio_gang_release();
+      return false;
+    }
 
-inline bool swio_halt(void) {
-  dm_set_control(DMC_ACTIVE | DMC_HALTREQ);
-  if (!dm_status_wait(DMS_ANYHALTED | DMS_ALLHALTED, DMS_ANYHALTED | DMS_ALLHALTED))
-    return false;
+    t->pin = pin;
+    t->linked = true;
+    t->diverged = 0;
+    gang_count++;
 
-  dm_set_control(DMC_ACTIVE);
-  return true;
-}
+    // Set GPIO drive characteristics
+    gpio_set_drive_strength(pin, GPIO_DRIVE_STRENGTH_2MA);
+    gpio_set_slew_rate(pin, GPIO_SLEW_RATE_SLOW);
 
-//------------------------------------------------------------------------------
-// NOTE: DMC_RESUMEREQ is cleared automatically once the MCU resumes execution
+    swio_target_init(t);
+    pio_gpio_init(t->pio, pin);
+  }
 
-inline bool swio_resume(void) {
-  dm_set_control(DMC_ACTIVE | DMC_RESUMEREQ);
-  return dm_status_wait(DMS_ANYRUNNING | DMS_ALLRUNNING, DMS_ANYRUNNING | DMS_ALLRUNNING);
+  swio_sample_apply();
+  return true;
 }
 
 //------------------------------------------------------------------------------
 
-inline bool swio_step(void) {
-  dm_set_control(DMC_ACTIVE | DMC_RESUMEREQ);
-  return dm_status_wait(DMS_ANYRESUMEACK | DMS_ALLRESUMEACK, DMS_ANYRESUMEACK | DMS_ALLRESUMEACK);
-}
-
-//==============================================================================
-// Transfer data
+uint8_t swio_gang_failed(void) {
+  uint8_t failed = 0;
 
-uint32_t swio_get(uint8_t addr) {
-  pio_sm_put_blocking(pio, sm, addr | 1);
-  uint32_t data = pio_sm_get_blocking(pio, sm);
+  for (int i = 0; i < gang_count; i++)
+    if (!gang[i].linked || gang[i].diverged)
+      failed |= 1u << i;
 
-#if SWIO_DUMP
-  const char *name = dm_str(addr);
-  print_c(0, "%s -> %08X\n", name, data);
-#endif
-  return data;
+  return failed;
 }
 
 //------------------------------------------------------------------------------
 
-void swio_put(uint8_t addr, uint32_t data) {
-#if SWIO_DUMP
-  const char *name = dm_str(addr);
-  print_c(0, "%s <- %08X\n", name, data);
-#endif
+void swio_gang_dump(void) {
+  print_y(0, "swio:gang\n");
 
-  pio_sm_put_blocking(pio, sm, addr);
-  pio_sm_put_blocking(pio, sm, ~data);
+  for (int i = 0; i < gang_count; i++) {
+    const swio_target *t = &gang[i];
+    print_b(2, "%d", i);
+    printf(": GP%d  pio%d sm%d  ", t->pin, pio_get_index(t->pio), t->sm);
+
+    if (!t->linked)
+      print_r(0, "no link\n");
+    else if (t->diverged)
+      print_r(0, "diverged (%d reads, first %s)\n", t->diverged, dm_str(t->first));
+    else
+      print_g(0, "ok\n");
+  }
 }
 
 //==============================================================================
@@ -277,6 +1233,24 @@ static inline void swio_tick_dump(void) {
 
   float tick = 1e9 * div / clock_get_hz(clk_sys);
   print_num(2, "tick (ns)", tick);
+
+  const swio_prog *p = &swio_progs[mode];
+  uint8_t release = pio_instr_delay(pio->instr_mem[offset + p->release]);
+  print_num(2, "sample (ticks after release)", release + 1);
+}
+
+//------------------------------------------------------------------------------
+// Back-to-back DATA0 reads through the queue
+
+static void swio_stats_dump(void) {
+  print_str(2, "link", link_check ? "checked" : "raw");
+  print_num(2, "checked", stats.checked);
+  print_num(2, "errors", stats.errors);
+  print_num(2, "retries", stats.retries);
+  print_num(2, "failures", stats.failures);
+  print_num(2, "parity", stats.parity);
+  print_num(2, "skipped", stats.skipped);
+  print_num(2, "resyncs", stats.resyncs);
 }
 
 //------------------------------------------------------------------------------
@@ -288,8 +1262,11 @@ static void swio_pio_dump(void) {
   print_num(2, "block", block);
   print_num(2, "sm", sm);
   print_num(2, "offset", offset);
+  print_str(2, "mode", swio_progs[mode].name);
 
   swio_tick_dump();
+  print_num(2, "throughput (B/s)", throughput);
+  swio_stats_dump();
 }
 
 //------------------------------------------------------------------------------
@@ -305,7 +1282,7 @@ void swio_dump(void) {
   dm_cfgr_dump(DM_CFGR, cfgr);
 
   dm_cfgr shdwcfgr = dm_get_shdwcfgr();
-  dm_cfgr_dump(DM_SHDWCFGR, cfgr);
+  dm_cfgr_dump(DM_SHDWCFGR, shdwcfgr);
 
   uint32_t chipid = dm_get_chipid();
   vndb_chipid_dump("DM_CHIPID", (vndb_chipid)chipid);
@@ -315,15 +1292,20 @@ void swio_dump(void) {
 // Debug interface registers
 
 bool dm_status_wait(uint32_t mask, uint32_t value) {
-  for (int i = 0; i < 200; i++) {  // Timeout 10 ms
+  waiter w;
+  wait_begin(&w, WAIT_STATUS);
+
+  do {
     dm_status status = dm_get_status();
-    if ((status.raw & mask) == value)
+    last_status = status.raw;
+    if ((status.raw & mask) == value) {
+      wait_end(&w);
       return true;
-
-    sleep_us(50);
-  }
+    }
+  } while (wait_next(&w, 10000));  // Timeout 10 ms
 
   print_r(2, "DM_STATUS: timeout (mask=%08X expected=%08X)\n", mask, value);
+  swio_shadow_invalidate();
   return false;
 }
 
@@ -435,29 +1417,327 @@ void dm_hartinfo_dump(dm_hartinfo r) {
 //==============================================================================
 
 bool dm_abstractcs_wait(void) {
-  for (int i = 0; i < 80; i++) {  // Timeout 4 ms
+  waiter w;
+  wait_begin(&w, command_class);
+
+  do {
     dm_abstractcs abstractcs = dm_get_abstractcs();
-    if (abstractcs.raw & DMA_BUSY) {
-      sleep_us(50);
+    if (abstractcs.raw & DMA_BUSY)
       continue;
-    }
+
+    wait_end(&w);
 
     // If cmderr is 0, the abstract command executed successfully
     if (abstractcs.b.CMDER) {
+      if (abstractcs.b.CMDER == CMDER_PARITY)
+        stats.parity++;
       print_r(2, "abstract command failed");
       dm_cmder_dump(abstractcs.b.CMDER, false);
+      swio_shadow_invalidate();
+      return false;
+    }
+
+    // DATA0/DATA1/PROGBUF went out wrong, whatever the command did is garbage
+    if (!swio_link_ok()) {
+      print_r(2, "abstract command: link error\n");
       return false;
     }
 
     return true;
-  }
+  } while (wait_next(&w, 4000));  // Timeout 4 ms
 
   print_r(2, "abstract command timeout\n");
+  swio_shadow_invalidate();
+  return false;  // Timeout
+}
+
+//------------------------------------------------------------------------------
+
+static bool dm_abstractcs_check(uint32_t raw) {
+  dm_abstractcs abstractcs = { .raw = raw };
+
+  if (abstractcs.b.CMDER) {
+    if (abstractcs.b.CMDER == CMDER_PARITY)
+      stats.parity++;
+
+    print_r(2, "abstract command failed");
+    dm_cmder_dump(abstractcs.b.CMDER, false);
+    swio_shadow_invalidate();
+    return false;
+  }
+
+  // The next kick was sent while the previous one was still running
+  if (abstractcs.b.BUSY) {
+    print_r(2, "abstract command busy\n");
+    swio_shadow_invalidate();
+    return false;
+  }
+
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Streams words through DATA0 with autoexec on DATA0 enabled. The words go
+// out as one PIO block. A kick that is still running when the next word
+// arrives sets the sticky CMDER, which dm_abstractcs_wait() reports once the
+// last kick (possibly a slow flash page write) has finished.
+
+bool dm_put_data0_stream(const uint32_t *data, size_t count) {
+  swio_put_block(DM_DATA0, data, count);
+  return dm_abstractcs_wait();
+}
+
+//------------------------------------------------------------------------------
+// Every read kicks the next word, so each one but the last is followed by an
+// ABSTRACTCS read in the same batch. The last kick is polled by
+// dm_abstractcs_wait().
+
+bool dm_get_data0_stream(uint32_t *data, size_t count) {
+  swio_xfer xfers[SWIO_QUEUE_MAX];
+
+  while (count) {
+    size_t chunk = count < SWIO_QUEUE_MAX / 2 ? count : SWIO_QUEUE_MAX / 2;
+    size_t n = 0;
+
+    for (size_t i = 0; i < chunk; i++) {
+      xfers[n++] = (swio_xfer) { DM_DATA0, true, 0 };
+      xfers[n++] = (swio_xfer) { DM_ABSTRACTCS, true, 0 };
+    }
+
+    // Leave the last poll to dm_abstractcs_wait()
+    bool last = chunk == count;
+    if (last)
+      n--;
+
+    swio_transfer(xfers, n);
+
+    for (size_t i = 0; i < chunk; i++) {
+      data[i] = xfers[i * 2].data;
+      if ((!last || i < chunk - 1) && !dm_abstractcs_check(xfers[i * 2 + 1].data))
+        return false;
+    }
+
+    data += chunk;
+    count -= chunk;
+  }
+
+  return dm_abstractcs_wait();
+}
+
+//------------------------------------------------------------------------------
+// DATA0 then DATA1 per pair, the DATA1 write kicks the stub.
+
+static void dm_put_data01(const uint32_t *data, size_t pairs) {
+  swio_xfer xfers[SWIO_QUEUE_MAX];
+
+  while (pairs) {
+    size_t chunk = pairs < SWIO_QUEUE_MAX / 2 ? pairs : SWIO_QUEUE_MAX / 2;
+    size_t n = 0;
+
+    for (size_t i = 0; i < chunk; i++) {
+      xfers[n++] = (swio_xfer) { DM_DATA0, false, data[i * 2] };
+      xfers[n++] = (swio_xfer) { DM_DATA1, false, data[i * 2 + 1] };
+    }
+
+    swio_transfer(xfers, n);
+    data += chunk * 2;
+    pairs -= chunk;
+  }
+}
+
+//------------------------------------------------------------------------------
+
+bool dm_put_data01_stream(const uint32_t *data, size_t pairs) {
+  dm_put_data01(data, pairs);
+  return dm_abstractcs_wait();
+}
+
+//------------------------------------------------------------------------------
+// Like dm_get_data0_stream, but the DATA1 read of each pair kicks the next one.
+
+bool dm_get_data01_stream(uint32_t *data, size_t pairs) {
+  swio_xfer xfers[SWIO_QUEUE_MAX];
+
+  while (pairs) {
+    size_t chunk = pairs < SWIO_QUEUE_MAX / 3 ? pairs : SWIO_QUEUE_MAX / 3;
+    size_t n = 0;
+
+    for (size_t i = 0; i < chunk; i++) {
+      xfers[n++] = (swio_xfer) { DM_DATA0, true, 0 };
+      xfers[n++] = (swio_xfer) { DM_DATA1, true, 0 };
+      xfers[n++] = (swio_xfer) { DM_ABSTRACTCS, true, 0 };
+    }
+
+    // Leave the last poll to dm_abstractcs_wait()
+    bool last = chunk == pairs;
+    if (last)
+      n--;
+
+    swio_transfer(xfers, n);
+
+    for (size_t i = 0; i < chunk; i++) {
+      data[i * 2] = xfers[i * 3].data;
+      data[i * 2 + 1] = xfers[i * 3 + 1].data;
+      if ((!last || i < chunk - 1) && !dm_abstractcs_check(xfers[i * 3 + 2].data))
+        return false;
+    }
+
+    data += chunk * 2;
+    pairs -= chunk;
+  }
+
+  return dm_abstractcs_wait();
+}
+
+//==============================================================================
+// Optimistic streams
+//
+// The stubs finish in a few target cycles, far less than one SWIO frame, so
+// words go back to back without polling ABSTRACTCS. A kick that is overtaken
+// sets the sticky CMDER, which also blocks every following kick, and the one
+// check at the end catches it. The caller then runs the chunk again.
+
+static bool dm_stream_settle(void) {
+  waiter w;
+  wait_begin(&w, command_class);
+
+  do {
+    dm_abstractcs abstractcs = dm_get_abstractcs();
+    if (abstractcs.raw & DMA_BUSY)
+      continue;
+
+    wait_end(&w);
+    if (!abstractcs.b.CMDER)
+      return true;
+
+    stats.resyncs++;
+    dm_abstractcs_clear_err();
+    swio_shadow_invalidate();
+    return false;
+  } while (wait_next(&w, 4000));  // Timeout 4 ms
+
+  swio_shadow_invalidate();
   return false;  // Timeout
 }
 
 //------------------------------------------------------------------------------
 
+bool dm_put_data0_burst(const uint32_t *data, size_t count) {
+  swio_put_block(DM_DATA0, data, count);
+  return dm_stream_settle();
+}
+
+//------------------------------------------------------------------------------
+
+bool dm_get_data0_burst(uint32_t *data, size_t count) {
+  swio_xfer xfers[SWIO_QUEUE_MAX];
+
+  while (count) {
+    size_t chunk = count < SWIO_QUEUE_MAX ? count : SWIO_QUEUE_MAX;
+
+    for (size_t i = 0; i < chunk; i++)
+      xfers[i] = (swio_xfer) { DM_DATA0, true, 0 };
+
+    swio_transfer(xfers, chunk);
+
+    for (size_t i = 0; i < chunk; i++)
+      data[i] = xfers[i].data;
+
+    data += chunk;
+    count -= chunk;
+  }
+
+  return dm_stream_settle();
+}
+
+//------------------------------------------------------------------------------
+
+bool dm_put_data01_burst(const uint32_t *data, size_t pairs) {
+  dm_put_data01(data, pairs);
+  return dm_stream_settle();
+}
+
+//------------------------------------------------------------------------------
+
+bool dm_get_data01_burst(uint32_t *data, size_t pairs) {
+  swio_xfer xfers[SWIO_QUEUE_MAX];
+
+  while (pairs) {
+    size_t chunk = pairs < SWIO_QUEUE_MAX / 2 ? pairs : SWIO_QUEUE_MAX / 2;
+    size_t n = 0;
+
+    for (size_t i = 0; i < chunk; i++) {
+      xfers[n++] = (swio_xfer) { DM_DATA0, true, 0 };
+      xfers[n++] = (swio_xfer) { DM_DATA1, true, 0 };
+    }
+
+    swio_transfer(xfers, n);
+
+    for (size_t i = 0; i < n; i++)
+      data[i] = xfers[i].data;
+
+    data += n;
+    pairs -= chunk;
+  }
+
+  return dm_stream_settle();
+}
+
+//------------------------------------------------------------------------------
+// DATA1 write kicks, DATA0 read collects the result.
+
+bool dm_gather_data0(const uint32_t *addrs, uint32_t *data, size_t count) {
+  swio_xfer xfers[SWIO_QUEUE_MAX];
+
+  while (count) {
+    size_t chunk = count < SWIO_QUEUE_MAX / 2 ? count : SWIO_QUEUE_MAX / 2;
+    size_t n = 0;
+
+    for (size_t i = 0; i < chunk; i++) {
+      xfers[n++] = (swio_xfer) { DM_DATA1, false, addrs[i] };
+      xfers[n++] = (swio_xfer) { DM_DATA0, true, 0 };
+    }
+
+    swio_transfer(xfers, n);
+
+    for (size_t i = 0; i < chunk; i++)
+      data[i] = xfers[i * 2 + 1].data;
+
+    addrs += chunk;
+    data += chunk;
+    count -= chunk;
+  }
+
+  return dm_stream_settle();
+}
+
+//------------------------------------------------------------------------------
+// DATA0 then the DATA1 write that kicks.
+
+bool dm_scatter_data0(const uint32_t *addrs, const uint32_t *data, size_t count, uint32_t tag) {
+  swio_xfer xfers[SWIO_QUEUE_MAX];
+
+  while (count) {
+    size_t chunk = count < SWIO_QUEUE_MAX / 2 ? count : SWIO_QUEUE_MAX / 2;
+    size_t n = 0;
+
+    for (size_t i = 0; i < chunk; i++) {
+      xfers[n++] = (swio_xfer) { DM_DATA0, false, data[i] };
+      xfers[n++] = (swio_xfer) { DM_DATA1, false, addrs[i] | tag };
+    }
+
+    swio_transfer(xfers, n);
+
+    addrs += chunk;
+    data += chunk;
+    count -= chunk;
+  }
+
+  return dm_stream_settle();
+}
+
+//------------------------------------------------------------------------------
+
 void dm_cmder_dump(dm_cmder_t cmder, bool print_name) {
   const char *desc;
 
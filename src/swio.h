@@ -3,12 +3,19 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #include "def.h"
+#include "utils.h"
 
 //------------------------------------------------------------------------------
 
+typedef enum {
+  SWIO_NORMAL,
+  SWIO_FAST
+} swio_mode;
+
 bool swio_init(void);
 void swio_dump(void);
 
@@ -16,10 +23,60 @@ uint32_t swio_get(uint8_t addr);
 void swio_put(uint8_t addr, uint32_t data);
 
 bool swio_reset(void);
-bool swio_halt(void);
+bool swio_halt(bool *reset);
 bool swio_resume(void);
 bool swio_step(void);
 
+//------------------------------------------------------------------------------
+// Link errors since the last swio_reset(), see swio_get()
+
+#define SWIO_RETRIES  3
+
+typedef struct {
+  uint32_t checked;   // Transactions verified
+  uint32_t errors;    // Transactions that needed a retry
+  uint32_t retries;   // Repeated frames
+  uint32_t failures;  // Transactions that ran out of retries
+  uint32_t parity;    // CMDER parity errors reported by the debug module
+  uint32_t skipped;   // Writes dropped by the shadow, see swio_put()
+  uint32_t resyncs;   // Optimistic stream chunks that failed, see dm_stream_settle()
+} swio_stats;
+
+const swio_stats *swio_get_stats(void);
+
+// False if a checked transaction ran out of retries since the last call,
+// dm_abstractcs_wait() fails the command then
+bool swio_link_ok(void);
+
+// Forget the shadowed register values, the next writes go out
+void swio_shadow_invalidate(void);
+
+//------------------------------------------------------------------------------
+// Gang: extra targets on their own pins get every transaction the main target
+// gets. Reads return the main target's value, except STATUS (all targets must
+// agree) and ABSTRACTCS (busy or error on any target); other reads that differ
+// mark the target as diverged. The new gang is attached by swio_reset().
+
+#define SWIO_GANG_MAX  8
+
+bool swio_gang_set(uint32_t pins);  // Pin mask of the extra targets, 0 = none
+uint8_t swio_gang_failed(void);     // Bit mask of targets without link or diverged
+void swio_gang_dump(void);
+
+//------------------------------------------------------------------------------
+// Transaction queue, DMA feeds the PIO and drains the results
+
+#define SWIO_QUEUE_MAX  64
+
+typedef struct {
+  uint8_t  addr;
+  bool     read;
+  uint32_t data;  // Value to write or the value read
+} swio_xfer;
+
+void swio_transfer(swio_xfer *xfers, size_t count);
+void swio_put_block(uint8_t addr, const uint32_t *data, size_t count);
+
 //==============================================================================
 // Debug interface registers
 
@@ -82,6 +139,29 @@ inline uint32_t dm_get_data(uint8_t i) {
 inline uint32_t dm_get_data0(void) { return dm_get_data(0); }
 inline uint32_t dm_get_data1(void) { return dm_get_data(1); }
 
+bool dm_put_data0_stream(const uint32_t *data, size_t count);
+
+// dm_abstractcs_wait() learns per class, the next COMMAND write resets it
+void swio_set_command_class(wait_class cls);
+bool dm_get_data0_stream(uint32_t *data, size_t count);
+
+// Two words per kick, autoexec on DATA1
+bool dm_put_data01_stream(const uint32_t *data, size_t pairs);
+bool dm_get_data01_stream(uint32_t *data, size_t pairs);
+
+// Optimistic streams, ABSTRACTCS is checked once at the end. A failure is
+// quiet and clears CMDER, none of the words can be trusted then.
+bool dm_put_data0_burst(const uint32_t *data, size_t count);
+bool dm_get_data0_burst(uint32_t *data, size_t count);
+
+bool dm_put_data01_burst(const uint32_t *data, size_t pairs);
+bool dm_get_data01_burst(uint32_t *data, size_t pairs);
+
+// Address lists, every DATA1 write runs the last command (autoexec on DATA1).
+// tag is ORed into the addresses. Checked once at the end like the bursts.
+bool dm_gather_data0(const uint32_t *addrs, uint32_t *data, size_t count);
+bool dm_scatter_data0(const uint32_t *addrs, const uint32_t *data, size_t count, uint32_t tag);
+
 //------------------------------------------------------------------------------
 // Debug module control register
 
@@ -276,6 +356,11 @@ typedef enum {
 #define DMCM_AARPOSTINC  (1u << 19)
 #define DMCM_AARSIZE(s)  (AARSIZE##s << 20)
 
+// Access memory command, address in DATA1 and data in DATA0
+#define DMCM_ACCESS_MEM  ((uint32_t)DM_ACCESS_MEM << 24)
+#define DMCM_AAMPOSTINC  DMCM_AARPOSTINC
+#define DMCM_AAMSIZE(s)  DMCM_AARSIZE(s)
+
 typedef union {
   uint32_t raw;
   struct {
@@ -412,6 +497,8 @@ inline dm_cpbr dm_get_cpbr(void) {
  
 #define DM_CFGR  PIO_ADDR(0x7D)  // 4
 
+#define DMCF_TDIV(n)   ((n) & 3)
+#define DMCF_SOPN(n)   (((n) & 3) << 4)
 #define DMCF_CHECKEN   (1u << 8)
 #define DMCF_CMDEXTEN  (1u << 9)
 #define DMCF_OUTEN     (1u << 10)
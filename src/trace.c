@@ -0,0 +1,225 @@
+#include <stdio.h>
+#include <string.h>
+#include <pico/stdio.h>
+#include <pico/time.h>
+
+#include "swio.h"
+#include "trace.h"
+#include "utils.h"
+
+//------------------------------------------------------------------------------
+
+static trace_rec ring[TRACE_MAX];
+static uint32_t head;  // Records written, the ring keeps the last TRACE_MAX
+static bool enabled;
+
+//------------------------------------------------------------------------------
+// NOTE: Called from the SWIO hot path, keep it short
+
+void trace_add(uint8_t addr, bool read, uint32_t data) {
+  if (!enabled)
+    return;
+
+  trace_rec *r = &ring[head++ % TRACE_MAX];
+  r->time = time_us_32();
+  r->data = data;
+  r->addr = addr | read;
+}
+
+//------------------------------------------------------------------------------
+
+inline void trace_start(void) {
+  enabled = true;
+}
+
+//------------------------------------------------------------------------------
+
+inline void trace_stop(void) {
+  enabled = false;
+}
+
+//------------------------------------------------------------------------------
+
+inline void trace_clear(void) {
+  head = 0;
+}
+
+//------------------------------------------------------------------------------
+// Oldest record first
+
+static inline uint32_t trace_count(void) {
+  return head < TRACE_MAX ? head : TRACE_MAX;
+}
+
+static inline const trace_rec *trace_get(uint32_t i) {
+  return &ring[(head - trace_count() + i) % TRACE_MAX];
+}
+
+//==============================================================================
+// Dump
+
+void trace_dump(void) {
+  print_y(0, "trace:dump\n");
+
+  uint32_t count = trace_count();
+  print_num(2, "records", count);
+  print_num(2, "lost", head - count);
+  if (!count)
+    return;
+
+  // Times relative to the first record
+  uint32_t start = trace_get(0)->time;
+  for (uint32_t i = 0; i < count; i++) {
+    const trace_rec *r = trace_get(i);
+    printf("  %8d %c %-12s %08X\n", r->time - start, r->addr & 1 ? 'R' : 'W',
+           dm_str(r->addr & ~1), r->data);
+  }
+}
+
+//------------------------------------------------------------------------------
+// Header line with the record count, then the records as stored (little
+// endian, 12 bytes each). tools/trace_replay.py reads it back.
+
+void trace_dump_raw(void) {
+  uint32_t count = trace_count();
+  printf("TRACE %d %d\n", count, (int)sizeof(trace_rec));
+
+  for (uint32_t i = 0; i < count; i++) {
+    const uint8_t *p = (const uint8_t *)trace_get(i);
+    for (size_t j = 0; j < sizeof(trace_rec); j++)
+      putchar_raw(p[j]);
+  }
+}
+
+//==============================================================================
+// Replay against a software model of the debug module. The model only tracks
+// values, it doesn't execute anything: a command or an autoexec access makes
+// DATA0/DATA1 unknown.
+
+typedef enum {
+  MODEL_DATA0,
+  MODEL_DATA1,
+  MODEL_CONTROL,
+  MODEL_ABSTRACTAUTO,
+  MODEL_PROGBUF0,
+  MODEL_MAX = MODEL_PROGBUF0 + 8
+} model_reg;
+
+typedef struct {
+  uint32_t value[MODEL_MAX];
+  uint32_t known;  // Bit mask of model_reg
+} dm_model;
+
+typedef struct {
+  uint8_t addr;
+  uint32_t reads;
+  uint32_t writes;
+  uint32_t redundant;    // Writes of the value the DM already held
+  uint32_t predictable;  // Reads the model already knew
+} replay_stats;
+
+//------------------------------------------------------------------------------
+
+static int model_index(uint8_t addr) {
+  switch (addr) {
+    case DM_DATA0:         return MODEL_DATA0;
+    case DM_DATA1:         return MODEL_DATA1;
+    case DM_CONTROL:       return MODEL_CONTROL;
+    case DM_ABSTRACTAUTO:  return MODEL_ABSTRACTAUTO;
+  }
+
+  if (addr <= DM_PROGBUF0 && addr >= DM_PROGBUF(7) && !(addr & 1))
+    return MODEL_PROGBUF0 + (DM_PROGBUF0 - addr) / 2;
+
+  return -1;
+}
+
+//------------------------------------------------------------------------------
+// Does the access kick the abstract command?
+
+static bool model_autoexec(const dm_model *m, uint8_t addr) {
+  if (!(m->known & (1u << MODEL_ABSTRACTAUTO)))
+    return true;  // Assume the worst
+
+  uint32_t aa = m->value[MODEL_ABSTRACTAUTO];
+  int i = model_index(addr);
+  if (i == MODEL_DATA0 || i == MODEL_DATA1)
+    return aa & DMAA_DATA(i - MODEL_DATA0);
+  if (i >= MODEL_PROGBUF0)
+    return aa & DMAA_PROGBUF(i - MODEL_PROGBUF0);
+  return false;
+}
+
+//------------------------------------------------------------------------------
+
+static replay_stats *replay_find(replay_stats *stats, size_t *count, uint8_t addr) {
+  for (size_t i = 0; i < *count; i++)
+    if (stats[i].addr == addr)
+      return &stats[i];
+
+  replay_stats *s = &stats[(*count)++];
+  memset(s, 0, sizeof(*s));
+  s->addr = addr;
+  return s;
+}
+
+//------------------------------------------------------------------------------
+
+void trace_replay(void) {
+  print_y(0, "trace:replay\n");
+
+  // Registers seen in the trace, 128 DM addresses at most
+  static replay_stats stats[128];
+  size_t stats_count = 0;
+
+  dm_model model = { 0 };
+  uint32_t count = trace_count();
+  uint32_t gap = 0;
+
+  for (uint32_t i = 0; i < count; i++) {
+    const trace_rec *r = trace_get(i);
+    uint8_t addr = r->addr & ~1;
+    bool read = r->addr & 1;
+
+    if (i && r->time - trace_get(i - 1)->time > gap)
+      gap = r->time - trace_get(i - 1)->time;
+
+    replay_stats *s = replay_find(stats, &stats_count, addr);
+    int m = model_index(addr);
+    bool known = m >= 0 && (model.known & (1u << m)) && model.value[m] == r->data;
+
+    if (read) {
+      s->reads++;
+      if (known && !model_autoexec(&model, addr))
+        s->predictable++;
+    } else {
+      s->writes++;
+      if (known && !model_autoexec(&model, addr) &&
+          (addr != DM_CONTROL || !(r->data & (DMC_HALTREQ | DMC_RESUMEREQ | DMC_ACKHAVERESET | DMC_NDMRESET))))
+        s->redundant++;
+    }
+
+    // The command may change the data registers
+    if (addr == DM_COMMAND || model_autoexec(&model, addr))
+      model.known &= ~((1u << MODEL_DATA0) | (1u << MODEL_DATA1));
+
+    if (m >= 0) {
+      model.value[m] = r->data;
+      model.known |= 1u << m;
+    }
+  }
+
+  print_num(2, "records", count);
+  if (count)
+    print_num(2, "span (us)", trace_get(count - 1)->time - trace_get(0)->time);
+  print_num(2, "longest gap (us)", gap);
+
+  printf("  %-12s %8s %8s %10s %12s\n", "register", "reads", "writes", "redundant", "predictable");
+  for (size_t i = 0; i < stats_count; i++) {
+    const replay_stats *s = &stats[i];
+    printf("  %-12s %8d %8d %10d %12d\n", dm_str(s->addr), s->reads, s->writes,
+           s->redundant, s->predictable);
+  }
+}
+
+//------------------------------------------------------------------------------
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "def.h"
+
+//------------------------------------------------------------------------------
+// Binary trace of the SWIO traffic, see SWIO_TRACE in def.h
+
+#define TRACE_MAX  1024  // Records, 12 KB
+
+typedef struct {
+  uint32_t time;  // time_us_32()
+  uint32_t data;
+  uint8_t  addr;  // DM address, bit 0 set for reads (same as the PIO header)
+} trace_rec;
+
+void trace_add(uint8_t addr, bool read, uint32_t data);
+
+void trace_start(void);
+void trace_stop(void);
+void trace_clear(void);
+
+void trace_dump(void);
+void trace_dump_raw(void);
+void trace_replay(void);
@@ -1,6 +1,7 @@
 #include <ctype.h>
 #include <stdio.h>
 #include <pico/status_led.h>
+#include <pico/time.h>
 
 #include "utils.h"
 
@@ -135,6 +136,20 @@ bool from_hex_check(uint8_t b, uint8_t *out) {
   return false;
 }
 
+//==============================================================================
+// CRC-32 (IEEE, reflected), the same as ctx_crc32() computes on the target
+
+uint32_t crc32_calc(const uint8_t *data, size_t size) {
+  uint32_t crc = ~0u;
+
+  while (size--) {
+    crc ^= *data++;
+    for (int i = 0; i < 8; i++)
+      crc = (crc >> 1) ^ (CRC32_POLY & -(crc & 1));
+  }
+  return ~crc;
+}
+
 //==============================================================================
 // Colored status LED
 
@@ -173,4 +188,119 @@ void cled_set_color(uint8_t idx) {
   colored_status_led_set_color(cled_colors[idx]);
  }
 
+//==============================================================================
+// Wait
+
+#define WAIT_BUCKETS    16  // log2(us), the last one collects the rest
+#define WAIT_DELAY_MIN  1   // us
+#define WAIT_DELAY_MAX  64  // us, raised for slow classes
+
+typedef struct {
+  uint32_t typical;  // Moving average (us)
+  uint32_t max;      // us
+  uint32_t count;
+  uint32_t hist[WAIT_BUCKETS];
+} wait_stats;
+
+static wait_stats wait_classes[WAIT_MAX];
+
+static const char *const wait_names[WAIT_MAX] = {
+  [WAIT_REGISTER]    = "register",
+  [WAIT_PROGBUF]     = "progbuf",
+  [WAIT_STATUS]      = "status",
+  [WAIT_FLASH_BUF]   = "flash buf",
+  [WAIT_FLASH_PAGE]  = "flash page",
+  [WAIT_FLASH_FTER]  = "flash page erase",
+  [WAIT_FLASH_PER]   = "flash sector erase",
+  [WAIT_FLASH_MER]   = "flash chip erase"
+};
+
+//------------------------------------------------------------------------------
+
+inline void wait_begin(waiter *w, wait_class cls) {
+  w->cls = cls;
+  w->start = time_us_32();
+  w->delay = 0;
+}
+
+//------------------------------------------------------------------------------
+
+bool wait_next(waiter *w, uint32_t timeout) {
+  uint32_t elapsed = time_us_32() - w->start;
+  if (elapsed >= timeout)
+    return false;
+
+  wait_stats *s = &wait_classes[w->cls];
+  uint32_t delay;
+
+  if (!w->delay) {
+    // Undershoot the learned time a bit, the back-off covers the rest
+    uint32_t typical = s->typical * 3 / 4;
+    delay = typical > elapsed ? typical - elapsed : WAIT_DELAY_MIN;
+    w->delay = WAIT_DELAY_MIN;
+  } else {
+    uint32_t limit = s->typical / 4;
+    if (limit < WAIT_DELAY_MAX)
+      limit = WAIT_DELAY_MAX;
+
+    delay = w->delay;
+    if (w->delay < limit)
+      w->delay <<= 1;
+  }
+
+  if (delay > timeout - elapsed)
+    delay = timeout - elapsed;
+
+  sleep_us(delay);
+  return true;
+}
+
+//------------------------------------------------------------------------------
+
+void wait_end(waiter *w) {
+  uint32_t elapsed = time_us_32() - w->start;
+  wait_stats *s = &wait_classes[w->cls];
+
+  // Moving average over ~8 samples, the first one is taken as is
+  if (!s->count)
+    s->typical = elapsed;
+  else
+    s->typical = (s->typical * 7 + elapsed) / 8;
+
+  if (s->max < elapsed)
+    s->max = elapsed;
+  s->count++;
+
+  uint8_t bucket = 0;
+  while (elapsed >>= 1)
+    bucket++;
+  s->hist[bucket < WAIT_BUCKETS ? bucket : WAIT_BUCKETS - 1]++;
+}
+
+//------------------------------------------------------------------------------
+
+void wait_dump(void) {
+  print_y(0, "wait:info\n");
+
+  for (int i = 0; i < WAIT_MAX; i++) {
+    const wait_stats *s = &wait_classes[i];
+    print_b(2, "%s", wait_names[i]);
+    printf(": count %d  typical %d us  max %d us\n", s->count, s->typical, s->max);
+    if (!s->count)
+      continue;
+
+    // Bucket n holds [2^n, 2^(n+1)) us
+    for (int n = 0; n < WAIT_BUCKETS; n++) {
+      if (!s->hist[n])
+        continue;
+
+      uint32_t bar = (s->hist[n] * 40 + s->count - 1) / s->count;
+      printf("    <%6d us %6d ", 2u << n, s->hist[n]);
+      while (bar--)
+        putchar('#');
+      putchar('\n');
+    }
+  }
+}
+
 //------------------------------------------------------------------------------
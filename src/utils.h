@@ -85,6 +85,13 @@ void byte_to_hex(uint8_t b, uint8_t* hex);
 int from_hex(uint8_t b);
 bool from_hex_check(uint8_t b, uint8_t* out);
 
+//------------------------------------------------------------------------------
+// CRC-32
+
+#define CRC32_POLY  0xEDB88320  // Reflected 0x04C11DB7
+
+uint32_t crc32_calc(const uint8_t *data, size_t size);
+
 //------------------------------------------------------------------------------
 // 2*n CPU cycles → 16*n ns (1 cycle = 8 ns @ 125 MHz)
 
@@ -113,3 +120,31 @@ inline void delay_cycles(uint32_t n) {
 void cled_set_color(uint8_t idx);
 
 //------------------------------------------------------------------------------
+// Adaptive completion polling: the first poll is immediate, the first wait
+// jumps close to the completion time learned for the class, then the delay
+// backs off exponentially.
+
+typedef enum {
+  WAIT_REGISTER,     // Abstract register transfer
+  WAIT_PROGBUF,      // Program buffer execution
+  WAIT_STATUS,       // Halt, resume and reset
+  WAIT_FLASH_BUF,    // Flash buffer load/reset
+  WAIT_FLASH_PAGE,   // Flash page program
+  WAIT_FLASH_FTER,   // Flash page erase
+  WAIT_FLASH_PER,    // Flash sector erase
+  WAIT_FLASH_MER,    // Flash chip erase
+  WAIT_MAX
+} wait_class;
+
+typedef struct {
+  wait_class cls;
+  uint32_t start;  // time_us_32()
+  uint32_t delay;  // Next back-off delay (us), 0 = first wait
+} waiter;
+
+void wait_begin(waiter *w, wait_class cls);
+bool wait_next(waiter *w, uint32_t timeout);  // false once timeout (us) has passed
+void wait_end(waiter *w);
+void wait_dump(void);
+
+//------------------------------------------------------------------------------
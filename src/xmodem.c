@@ -103,16 +103,17 @@ static bool erase_flash_verify(void) {
   uint32_t word_count;
 
   if (data_size == 1024) {
-    if (!flash_erase_sector(dst_addr))
+    if (!flash_erase_sector((dst_addr - CH32_FLASH_ADDR) / CH32_FLASH_SECTOR_SIZE))
       return false;
 
     // XMODEM-1K maps to one flash sector (16 pages)
     word_count = CH32_FLASH_SECTOR_WORDS;
   } else {
     // Erase 2 pages
-    if (!flash_erase_page(dst_addr))
+    uint16_t page = (dst_addr - CH32_FLASH_ADDR) / CH32_FLASH_PAGE_SIZE;
+    if (!flash_erase_page(page))
       return false;
-    if (!flash_erase_page(dst_addr + CH32_FLASH_PAGE_SIZE))
+    if (!flash_erase_page(page + 1))
       return false;
 
     word_count = CH32_FLASH_PAGE_WORDS * 2;
@@ -121,8 +122,8 @@ static bool erase_flash_verify(void) {
   // Write and verify pages
   if (!flash_write_pages(dst_addr, (uint32_t *)data, word_count))
     return false;
-
-// !flash_verify_pages(dst_addr, (uint32_t *)data, word_count))
+  if (!flash_verify_pages(dst_addr, (uint32_t *)data, word_count))
+    return false;
 
   dst_addr += word_count * 4;
   return true;
@@ -330,7 +331,8 @@ header:
       }
 
       if (byte_in == EOT) {
-        cled_set_color(CLED_GREEN);
+        // Yellow if a gang target lost its link or diverged
+        cled_set_color(swio_gang_failed() ? CLED_YELLOW : CLED_GREEN);
         *byte_out = ACK;
         goto cancel;
       }
@@ -0,0 +1,167 @@
+#!/usr/bin/env python3
+#
+# Offline replay of a "trace raw" capture against a software model of the
+# debug module, same model as trace_replay() in src/trace.c.
+#
+#   tio --log --log-file trace.log /dev/ttyACM0   ; then "trace raw"
+#   tools/trace_replay.py trace.log [--dump]
+
+import struct
+import sys
+
+#-------------------------------------------------------------------------------
+# DM addresses as the PIO sends them, see PIO_ADDR in src/swio.h
+
+def pio_addr(x):
+  return (~x << 1) & 0xFF
+
+DM_DATA0        = pio_addr(0x04)
+DM_DATA1        = pio_addr(0x05)
+DM_CONTROL      = pio_addr(0x10)
+DM_COMMAND      = pio_addr(0x17)
+DM_ABSTRACTAUTO = pio_addr(0x18)
+DM_PROGBUF0     = pio_addr(0x20)
+DM_HALTSUM0     = pio_addr(0x40)
+
+def dm_progbuf(n):
+  return DM_PROGBUF0 - n * 2
+
+NAMES = {
+  DM_CONTROL:         "DM_CONTROL",
+  pio_addr(0x11):     "DM_STATUS",
+  pio_addr(0x12):     "DM_HARTINFO",
+  pio_addr(0x16):     "DM_ABSTRACTCS",
+  DM_COMMAND:         "DM_COMMAND",
+  DM_ABSTRACTAUTO:    "DM_ABSTRACTAUTO",
+  DM_HALTSUM0:        "DM_HALTSUM",
+  pio_addr(0x7C):     "DM_CPBR",
+  pio_addr(0x7D):     "DM_CFGR",
+  pio_addr(0x7E):     "DM_SHDWCFGR",
+  pio_addr(0x7F):     "DM_CHIPID",
+}
+
+DMC_NDMRESET     = 1 << 1
+DMC_ACKHAVERESET = 1 << 28
+DMC_RESUMEREQ    = 1 << 30
+DMC_HALTREQ      = 1 << 31
+
+def dm_str(addr):
+  if addr in NAMES:
+    return NAMES[addr]
+  if DM_CONTROL < addr <= DM_DATA0:
+    return "DM_DATA%d" % ((DM_DATA0 - addr) >> 1)
+  if DM_HALTSUM0 < addr <= DM_PROGBUF0:
+    return "DM_PROGBUF%d" % ((DM_PROGBUF0 - addr) >> 1)
+  return "DM?"
+
+#-------------------------------------------------------------------------------
+# Model registers, DATA0/DATA1 become unknown on a command or autoexec access
+
+MODEL_DATA0, MODEL_DATA1, MODEL_CONTROL, MODEL_ABSTRACTAUTO, MODEL_PROGBUF0 = range(5)
+
+def model_index(addr):
+  index = {
+    DM_DATA0:        MODEL_DATA0,
+    DM_DATA1:        MODEL_DATA1,
+    DM_CONTROL:      MODEL_CONTROL,
+    DM_ABSTRACTAUTO: MODEL_ABSTRACTAUTO,
+  }.get(addr)
+  if index is not None:
+    return index
+  if dm_progbuf(7) <= addr <= DM_PROGBUF0 and not addr & 1:
+    return MODEL_PROGBUF0 + (DM_PROGBUF0 - addr) // 2
+  return None
+
+def model_autoexec(model, addr):
+  aa = model.get(MODEL_ABSTRACTAUTO)
+  if aa is None:
+    return True  # Assume the worst
+
+  i = model_index(addr)
+  if i in (MODEL_DATA0, MODEL_DATA1):
+    return bool(aa & (1 << (i - MODEL_DATA0)))
+  if i is not None and i >= MODEL_PROGBUF0:
+    return bool(aa & (1 << (i - MODEL_PROGBUF0 + 16)))
+  return False
+
+#-------------------------------------------------------------------------------
+
+def load(path):
+  raw = open(path, "rb").read()
+  start = raw.find(b"TRACE ")
+  if start < 0:
+    sys.exit("%s: no TRACE header" % path)
+
+  end = raw.index(b"\n", start)
+  count, size = map(int, raw[start + 6:end].split())
+  body = raw[end + 1:end + 1 + count * size]
+  if len(body) < count * size:
+    sys.exit("%s: %d of %d records" % (path, len(body) // size, count))
+
+  # trace_rec: time, data, addr (bit 0 = read), padded to size
+  return [struct.unpack_from("<IIB", body, i * size) for i in range(count)]
+
+#-------------------------------------------------------------------------------
+
+def replay(records):
+  stats = {}  # addr -> [reads, writes, redundant, predictable], trace order
+  model = {}
+  gap = 0
+
+  for i, (time, data, addr) in enumerate(records):
+    read = addr & 1
+    addr &= ~1
+
+    if i:
+      gap = max(gap, (time - records[i - 1][0]) & 0xFFFFFFFF)
+
+    s = stats.setdefault(addr, [0, 0, 0, 0])
+    m = model_index(addr)
+    known = m is not None and model.get(m) == data
+
+    if read:
+      s[0] += 1
+      if known and not model_autoexec(model, addr):
+        s[3] += 1
+    else:
+      s[1] += 1
+      if known and not model_autoexec(model, addr) and \
+         (addr != DM_CONTROL or not data & (DMC_HALTREQ | DMC_RESUMEREQ | DMC_ACKHAVERESET | DMC_NDMRESET)):
+        s[2] += 1
+
+    # The command may change the data registers
+    if addr == DM_COMMAND or model_autoexec(model, addr):
+      model.pop(MODEL_DATA0, None)
+      model.pop(MODEL_DATA1, None)
+
+    if m is not None:
+      model[m] = data
+
+  print("  records: %d" % len(records))
+  if records:
+    print("  span (us): %d" % ((records[-1][0] - records[0][0]) & 0xFFFFFFFF))
+  print("  longest gap (us): %d" % gap)
+
+  print("  %-12s %8s %8s %10s %12s" % ("register", "reads", "writes", "redundant", "predictable"))
+  for addr, s in stats.items():
+    print("  %-12s %8d %8d %10d %12d" % (dm_str(addr), *s))
+
+#-------------------------------------------------------------------------------
+
+def dump(records):
+  start = records[0][0] if records else 0
+  for time, data, addr in records:
+    print("  %8d %c %-12s %08X" % ((time - start) & 0xFFFFFFFF, "R" if addr & 1 else "W",
+                                   dm_str(addr & ~1), data))
+
+#-------------------------------------------------------------------------------
+
+if __name__ == "__main__":
+  args = [a for a in sys.argv[1:] if a != "--dump"]
+  if len(args) != 1:
+    sys.exit("usage: %s <capture> [--dump]" % sys.argv[0])
+
+  records = load(args[0])
+  if "--dump" in sys.argv:
+    dump(records)
+  replay(records)